@@ -1,7 +1,11 @@
+#include <cstring>
 #include <iostream>
+#include <string>
+#include <vector>
 
 #include <boost/program_options.hpp>
 
+#include <onmt/StreamTokenizer.h>
 #include <onmt/Tokenizer.h>
 
 namespace po = boost::program_options;
@@ -18,6 +22,8 @@ int main(int argc, char* argv[])
     ("case_feature,c", po::bool_switch()->default_value(false), "lowercase corpus and generate case feature")
     ("segment_case", po::bool_switch()->default_value(false), "Segment case feature, splits AbC to Ab C to be able to restore case")
     ("segment_numbers", po::bool_switch()->default_value(false), "Segment numbers into single digits")
+    ("segment_alphabet_change", po::bool_switch()->default_value(false), "Segment if the alphabet changes between 2 letters")
+    ("segment_alphabet", po::value<std::vector<std::string> >()->multitoken(), "Segment all letters from these alphabets, e.g. Han")
     ("bpe_model,bpe", po::value<std::string>()->default_value(""), "path to the BPE model")
     ;
 
@@ -42,19 +48,83 @@ int main(int argc, char* argv[])
     flags |= onmt::Tokenizer::Flags::SegmentCase;
   if (vm["segment_numbers"].as<bool>())
     flags |= onmt::Tokenizer::Flags::SegmentNumbers;
+  if (vm["segment_alphabet_change"].as<bool>())
+    flags |= onmt::Tokenizer::Flags::SegmentAlphabetChange;
 
-  onmt::ITokenizer* tokenizer = new onmt::Tokenizer(onmt::Tokenizer::mapMode.at(vm["mode"].as<std::string>()),
-                                                    flags,
-                                                    vm["bpe_model"].as<std::string>(),
-                                                    vm["joiner"].as<std::string>());
+  onmt::Tokenizer* tokenizer = new onmt::Tokenizer(onmt::Tokenizer::mapMode.at(vm["mode"].as<std::string>()),
+                                                   flags,
+                                                   vm["bpe_model"].as<std::string>(),
+                                                   vm["joiner"].as<std::string>());
 
-  std::string line;
+  if (vm.count("segment_alphabet"))
+  {
+    for (const auto& alphabet: vm["segment_alphabet"].as<std::vector<std::string> >())
+      tokenizer->add_alphabet_to_segment(alphabet);
+  }
+
+  // Lines are read by blocks and streamed, so that tokens of very long lines are written
+  // as soon as they are final.
+  onmt::StreamTokenizer stream(*tokenizer);
+  onmt::TokenBatch batch;
+  bool line_start = true;
+  bool line_pending = false;
+
+  std::string token;
+  auto write_tokens = [&tokenizer, &batch, &token, &line_start]() {
+    for (size_t i = 0; i < batch.size(); ++i)
+    {
+      if (!line_start)
+        std::cout << ' ';
+      line_start = false;
+      token.clear();
+      tokenizer->append_token(batch, i, token);
+      std::cout << token;
+      for (size_t j = 0; j < batch.num_features(); ++j)
+      {
+        if (i < batch.feature(j).size())
+          std::cout << onmt::ITokenizer::feature_marker << batch.feature(j)[i];
+      }
+      if (!batch.case_feature().empty())
+        std::cout << onmt::ITokenizer::feature_marker
+                  << onmt::CaseModifier::type_to_char(batch.case_feature()[i]);
+    }
+    batch.clear();
+  };
+
+  std::vector<char> buffer(1 << 16);
 
-  while (std::getline(std::cin, line))
+  while (std::cin.read(buffer.data(), buffer.size()) || std::cin.gcount() > 0)
   {
-    if (!line.empty())
-      std::cout << tokenizer->tokenize(line);
+    onmt::StringView block(buffer.data(), std::cin.gcount());
 
+    while (!block.empty())
+    {
+      const char* end = static_cast<const char*>(std::memchr(block.data(), '\n', block.size()));
+      const size_t length = end ? end - block.data() : block.size();
+      stream.feed(block.substr(0, length), batch);
+      line_pending = true;
+
+      if (end)
+      {
+        stream.finish(batch);
+        write_tokens();
+        std::cout << std::endl;
+        line_start = true;
+        line_pending = false;
+        block = block.substr(length + 1);
+      }
+      else
+      {
+        write_tokens();
+        block = onmt::StringView();
+      }
+    }
+  }
+
+  if (line_pending)
+  {
+    stream.finish(batch);
+    write_tokens();
     std::cout << std::endl;
   }
 
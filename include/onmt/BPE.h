@@ -1,9 +1,13 @@
 #pragma once
 
+#include <cstdint>
 #include <string>
 #include <unordered_map>
 #include <vector>
 
+#include "onmt/Workspace.h"
+#include "onmt/unicode/Unicode.h"
+
 namespace onmt
 {
 
@@ -13,6 +17,14 @@ namespace onmt
     BPE(const std::string& model_path);
 
     std::vector<std::string> encode(const std::string& str) const;
+    // Appends the subwords of str to pieces, as ranges of str.
+    void encode(StringView str, std::vector<StringView>& pieces, Workspace& workspace) const;
+    // Same without decoding str, which must be valid UTF-8: code_points contains the code
+    // point of each character at the offset of its first byte.
+    void encode(StringView str,
+                const unicode::code_point_t* code_points,
+                std::vector<StringView>& pieces,
+                Workspace& workspace) const;
 
   private:
     std::string _end_of_word;
@@ -21,19 +33,31 @@ namespace onmt
     bool _suffix;
     bool _case_insensitive;
 
-    struct pair_hash {
-    public:
-      template <typename T, typename U>
-      std::size_t operator()(const std::pair<T, U> &x) const
-      {
-        return std::hash<T>()(x.first) ^ std::hash<U>()(x.second);
-      }
+    struct Merge
+    {
+      int rank;
+      int symbol;
     };
 
-    std::unordered_map<std::pair<std::string, std::string>, int, pair_hash> _codes;
+    // Symbols (characters, markers and results of merges) are identified by their index.
+    // Merges are indexed by the pair of identifiers.
+    std::unordered_map<std::string, int> _symbols;
+    std::unordered_map<uint64_t, Merge> _merges;
+    std::unordered_map<unicode::code_point_t, int> _char_symbols;
+    int _ascii_symbols[128];
+    int _begin_of_word_symbol;
+    int _end_of_word_symbol;
+
+    int add_symbol(const std::string& symbol);
+    // Returns the identifier of a symbol, or -1 if it is not in the model.
+    int get_symbol(const std::string& symbol) const;
+    int get_char_symbol(unicode::code_point_t c) const;
+
+    // Encodes the characters of str stored in workspace.
+    void encode_chars(StringView str, std::vector<StringView>& pieces, Workspace& workspace) const;
 
-    std::pair<std::string, std::string>
-    get_min_pair(const std::vector<std::pair<std::string, std::string> >& pairs) const;
+    // Returns the index of the symbol starting the pair with the lowest rank, or -1.
+    int get_min_pair(const std::vector<Workspace::BPESymbol>& symbols, Merge& merge) const;
 
   };
 
@@ -1,14 +1,18 @@
 #pragma once
 
+#include <cstdint>
 #include <string>
 
+#include "onmt/StringView.h"
+#include "onmt/unicode/Unicode.h"
+
 namespace onmt
 {
 
   class CaseModifier
   {
   public:
-    enum class Type
+    enum class Type : uint8_t
     {
       Lowercase,
       Uppercase,
@@ -19,9 +23,17 @@ namespace onmt
     };
 
     static std::pair<std::string, char> extract_case(const std::string& token);
+    // Appends the lowercase form of token to output and returns its case.
+    static Type extract_case(StringView token, std::string& output);
     static std::string apply_case(const std::string& token, char feat);
+    static std::string apply_case(const std::string& token, Type case_type);
+    // Appends token with case_type applied to output.
+    static void apply_case(StringView token, Type case_type, std::string& output);
+
+    // Returns the case of a token after appending a letter of this type to a token of
+    // case current.
+    static Type update_case(Type current, unicode::_type_letter letter);
 
-  private:
     static char type_to_char(Type type);
     static Type char_to_type(char feature);
   };
@@ -3,6 +3,8 @@
 #include <vector>
 #include <string>
 
+#include "onmt/TokenBatch.h"
+
 namespace onmt
 {
 
@@ -15,18 +17,22 @@ namespace onmt
 
     virtual void tokenize(const std::string& text,
                           std::vector<std::string>& words,
-                          std::vector<std::vector<std::string> >& features) = 0;
-    virtual void tokenize(const std::string& text, std::vector<std::string>& words);
+                          std::vector<std::vector<std::string> >& features) const = 0;
+    virtual void tokenize(const std::string& text, std::vector<std::string>& words) const;
 
     virtual std::string detokenize(const std::vector<std::string>& words,
-                                   const std::vector<std::vector<std::string> >& features) = 0;
-    virtual std::string detokenize(const std::vector<std::string>& words);
+                                   const std::vector<std::vector<std::string> >& features) const = 0;
+    virtual std::string detokenize(const std::vector<std::string>& words) const;
+
+    // Tokenize into batch, replacing its content.
+    virtual void tokenize(const std::string& text, TokenBatch& batch) const;
+    virtual std::string detokenize(const TokenBatch& batch) const;
 
     // Tokenize and use spaces as token separators.
-    virtual std::string tokenize(const std::string& text);
+    virtual std::string tokenize(const std::string& text) const;
 
     // Split the text on spaces and detokenize.
-    virtual std::string detokenize(const std::string& text);
+    virtual std::string detokenize(const std::string& text) const;
   };
 
 }
@@ -12,12 +12,17 @@ namespace onmt
   public:
     static ITokenizer& get_instance();
 
+    using ITokenizer::tokenize;
+    using ITokenizer::detokenize;
+
     void tokenize(const std::string& text,
                   std::vector<std::string>& words,
-                  std::vector<std::vector<std::string> >& features) override;
+                  std::vector<std::vector<std::string> >& features) const override;
+    void tokenize(const std::string& text, TokenBatch& batch) const override;
 
     std::string detokenize(const std::vector<std::string>& words,
-                           const std::vector<std::vector<std::string> >& features) override;
+                           const std::vector<std::vector<std::string> >& features) const override;
+    std::string detokenize(const TokenBatch& batch) const override;
 
   };
 
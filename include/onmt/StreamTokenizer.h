@@ -0,0 +1,50 @@
+#pragma once
+
+#include <string>
+
+#include "onmt/StringView.h"
+#include "onmt/TokenBatch.h"
+#include "onmt/Tokenizer.h"
+#include "onmt/Workspace.h"
+
+namespace onmt
+{
+
+  // Tokenizes a text received in chunks of any size, e.g. a large document read by
+  // blocks. Chunks can end in the middle of a UTF-8 sequence or of a placeholder.
+  //
+  // Tokens are final after a separator that is not in a placeholder: the text is
+  // tokenized up to the last one and the rest is kept for the next chunk. The tokens are
+  // the same as when tokenizing the whole text, and the memory used is bounded by the
+  // longest part of the text without separator.
+  //
+  // The tokenizer must outlive the stream. Streams have their own Workspace: several
+  // streams can share a tokenizer, but a stream must be used by one thread at a time.
+  class StreamTokenizer
+  {
+  public:
+    StreamTokenizer(const Tokenizer& tokenizer);
+
+    // Appends chunk to the text and adds its final tokens to batch, after the tokens
+    // already in batch.
+    void feed(StringView chunk, TokenBatch& batch);
+    // Ends the text and adds its remaining tokens to batch. The stream can then be used
+    // for a new text.
+    void finish(TokenBatch& batch);
+
+  private:
+    const Tokenizer& _tokenizer;
+    Workspace _workspace;
+    Tokenizer::KernelRegisters _registers;
+
+    // Text not tokenized yet, searched for the positions where it can be split up to
+    // _search.offset.
+    std::string _text;
+    Tokenizer::SplitSearch _search;
+
+    // Returns the last position of _text where the tokens before it are final, or 0.
+    size_t find_split();
+    void reset();
+  };
+
+}
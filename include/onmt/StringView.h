@@ -0,0 +1,110 @@
+#pragma once
+
+#include <cstring>
+#include <ostream>
+#include <string>
+
+namespace onmt
+{
+
+  // Non-owning reference to a range of characters, similar to C++17 std::string_view.
+  // The referenced string must outlive the view.
+  class StringView
+  {
+  public:
+    static const size_t npos = static_cast<size_t>(-1);
+
+    StringView()
+      : _data(nullptr)
+      , _size(0)
+    {
+    }
+
+    StringView(const char* data, size_t size)
+      : _data(data)
+      , _size(size)
+    {
+    }
+
+    StringView(const char* str)
+      : _data(str)
+      , _size(std::strlen(str))
+    {
+    }
+
+    StringView(const std::string& str)
+      : _data(str.data())
+      , _size(str.size())
+    {
+    }
+
+    const char* data() const
+    {
+      return _data;
+    }
+
+    size_t size() const
+    {
+      return _size;
+    }
+
+    bool empty() const
+    {
+      return _size == 0;
+    }
+
+    const char* begin() const
+    {
+      return _data;
+    }
+
+    const char* end() const
+    {
+      return _data + _size;
+    }
+
+    char operator[](size_t pos) const
+    {
+      return _data[pos];
+    }
+
+    StringView substr(size_t pos, size_t count = npos) const
+    {
+      if (pos > _size)
+        pos = _size;
+      if (count > _size - pos)
+        count = _size - pos;
+      return StringView(_data + pos, count);
+    }
+
+    std::string to_string() const
+    {
+      return std::string(_data, _size);
+    }
+
+    explicit operator std::string() const
+    {
+      return to_string();
+    }
+
+  private:
+    const char* _data;
+    size_t _size;
+  };
+
+  inline bool operator==(const StringView& a, const StringView& b)
+  {
+    return a.size() == b.size() && (a.empty() || std::memcmp(a.data(), b.data(), a.size()) == 0);
+  }
+
+  inline bool operator!=(const StringView& a, const StringView& b)
+  {
+    return !(a == b);
+  }
+
+  inline std::ostream& operator<<(std::ostream& os, const StringView& view)
+  {
+    return os.write(view.data(), view.size());
+  }
+
+}
@@ -0,0 +1,264 @@
+#pragma once
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "onmt/CaseModifier.h"
+#include "onmt/StringView.h"
+
+namespace onmt
+{
+
+  // A token given as a range of bytes [begin, end) in the tokenized text.
+  struct TokenSpan
+  {
+    size_t begin;
+    size_t end;
+    bool joiner_left;  // A joiner is placed before the token.
+    bool joiner_right;  // A joiner is placed after the token.
+    // The token text is not the range itself: a character was substituted or escaped,
+    // or a control character was skipped. See Tokenizer::get_token_text.
+    bool substituted;
+  };
+
+  // Sequence of strings stored in a single buffer.
+  class StringColumn
+  {
+  public:
+    StringColumn()
+      : _offsets(1, 0)
+    {
+    }
+
+    size_t size() const
+    {
+      return _offsets.size() - 1;
+    }
+
+    bool empty() const
+    {
+      return size() == 0;
+    }
+
+    StringView operator[](size_t i) const
+    {
+      return StringView(_data.data() + _offsets[i], _offsets[i + 1] - _offsets[i]);
+    }
+
+    void push_back(StringView str)
+    {
+      _data.append(str.data(), str.size());
+      _offsets.push_back(_data.size());
+    }
+
+    // Appends str to the last string.
+    void append_back(StringView str)
+    {
+      _data.append(str.data(), str.size());
+      _offsets.back() = _data.size();
+    }
+
+    // Appends the strings of other.
+    void append(const StringColumn& other)
+    {
+      const size_t offset = _data.size();
+      _data += other._data;
+      for (size_t i = 1; i < other._offsets.size(); ++i)
+        _offsets.push_back(offset + other._offsets[i]);
+    }
+
+    // Keeps the first size strings.
+    void truncate(size_t size)
+    {
+      if (size < this->size())
+      {
+        _data.resize(_offsets[size]);
+        _offsets.resize(size + 1);
+      }
+    }
+
+    // Keeps the allocated memory.
+    void clear()
+    {
+      _data.clear();
+      _offsets.resize(1);
+    }
+
+  private:
+    std::string _data;
+    std::vector<size_t> _offsets;
+  };
+
+  // Tokens and their features stored by column. A batch can be reused across calls:
+  // clear() does not release memory.
+  //
+  // Joiners are not part of the token text: they are flags set by Tokenizer and are
+  // only written when tokens are serialized, e.g. with append_token.
+  class TokenBatch
+  {
+  public:
+    TokenBatch()
+      : _num_features(0)
+    {
+    }
+
+    size_t size() const
+    {
+      return _tokens.size();
+    }
+
+    bool empty() const
+    {
+      return _tokens.empty();
+    }
+
+    StringView token(size_t i) const
+    {
+      return _tokens[i];
+    }
+
+    const StringColumn& tokens() const
+    {
+      return _tokens;
+    }
+
+    StringColumn& tokens()
+    {
+      return _tokens;
+    }
+
+    bool joiner_left(size_t i) const
+    {
+      return i < _joiners.size() && (_joiners[i] & joiner_left_flag);
+    }
+
+    bool joiner_right(size_t i) const
+    {
+      return i < _joiners.size() && (_joiners[i] & joiner_right_flag);
+    }
+
+    // Sets the joiners placed around the last token.
+    void set_joiners(bool left, bool right)
+    {
+      _joiners.resize(size(), 0);
+      _joiners.back() = (left ? joiner_left_flag : 0) | (right ? joiner_right_flag : 0);
+    }
+
+    // Appends token i with its joiners to text.
+    void append_token(size_t i, StringView joiner, std::string& text) const
+    {
+      const StringView token = _tokens[i];
+      if (joiner_left(i))
+        text.append(joiner.data(), joiner.size());
+      text.append(token.data(), token.size());
+      if (joiner_right(i))
+        text.append(joiner.data(), joiner.size());
+    }
+
+    // Case of each token, empty if the case feature is not set.
+    const std::vector<CaseModifier::Type>& case_feature() const
+    {
+      return _case_feature;
+    }
+
+    std::vector<CaseModifier::Type>& case_feature()
+    {
+      return _case_feature;
+    }
+
+    // Features given as strings, e.g. when reading annotated text.
+    size_t num_features() const
+    {
+      return _num_features;
+    }
+
+    const StringColumn& feature(size_t i) const
+    {
+      return _features[i];
+    }
+
+    StringColumn& feature(size_t i)
+    {
+      return _features[i];
+    }
+
+    StringColumn& add_feature()
+    {
+      if (_num_features == _features.size())
+        _features.emplace_back();
+      else
+        _features[_num_features].clear();
+      return _features[_num_features++];
+    }
+
+    // Throws std::invalid_argument if a feature column, or the case feature when it is
+    // set, does not have a value per token.
+    void check_features() const
+    {
+      if (!_case_feature.empty() && _case_feature.size() != size())
+        throw std::invalid_argument("The case feature has "
+                                    + std::to_string(_case_feature.size())
+                                    + " values for " + std::to_string(size()) + " tokens");
+      for (size_t i = 0; i < _num_features; ++i)
+      {
+        if (_features[i].size() != size())
+          throw std::invalid_argument("Feature " + std::to_string(i) + " has "
+                                      + std::to_string(_features[i].size())
+                                      + " values for " + std::to_string(size()) + " tokens");
+      }
+    }
+
+    // Appends the tokens and features of other.
+    void append(const TokenBatch& other)
+    {
+      if (!other._joiners.empty())
+      {
+        _joiners.resize(size(), 0);
+        _joiners.insert(_joiners.end(), other._joiners.begin(), other._joiners.end());
+      }
+      _tokens.append(other._tokens);
+      _case_feature.insert(_case_feature.end(),
+                           other._case_feature.begin(),
+                           other._case_feature.end());
+      for (size_t i = 0; i < other._num_features; ++i)
+      {
+        if (i == _num_features)
+          add_feature();
+        _features[i].append(other._features[i]);
+      }
+    }
+
+    // Keeps the first size tokens and their features.
+    void truncate(size_t size)
+    {
+      _tokens.truncate(size);
+      if (size < _joiners.size())
+        _joiners.resize(size);
+      if (size < _case_feature.size())
+        _case_feature.resize(size);
+      for (size_t i = 0; i < _num_features; ++i)
+        _features[i].truncate(size);
+    }
+
+    void clear()
+    {
+      _tokens.clear();
+      _joiners.clear();
+      _case_feature.clear();
+      _num_features = 0;
+    }
+
+  private:
+    static const unsigned char joiner_left_flag = 1;
+    static const unsigned char joiner_right_flag = 2;
+
+    StringColumn _tokens;
+    // Joiner flags of each token, or of the first tokens only: the next ones have none.
+    std::vector<unsigned char> _joiners;
+    std::vector<CaseModifier::Type> _case_feature;
+    std::vector<StringColumn> _features;
+    size_t _num_features;
+  };
+
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "onmt/StringView.h"
+#include "onmt/TokenBatch.h"
+#include "onmt/Tokenizer.h"
+#include "onmt/Workspace.h"
+
+namespace onmt
+{
+
+  // A text and its tokens, kept up to date when the text is edited, e.g. in an editor
+  // that translates a document as it is typed.
+  //
+  // The text is stored in blocks that start at the positions where it can be split (see
+  // StreamTokenizer), each with its tokens. An edit only tokenizes again the blocks it
+  // touches, and the following ones until a block starts in the same tokenization state
+  // as before. The blocks are kept in a balanced tree that records the size of each
+  // subtree: finding the blocks of an edit and replacing them takes logarithmic time in
+  // the number of blocks, and the cost of an edit depends on its size and not on the
+  // size of the text.
+  //
+  // The tokenizer must outlive the text. A text must be used by one thread at a time.
+  class TokenizedText
+  {
+  public:
+    TokenizedText(const Tokenizer& tokenizer, StringView text = StringView());
+    ~TokenizedText();
+
+    // Replaces the length bytes of the text at offset by replacement.
+    void replace(size_t offset, size_t length, StringView replacement);
+
+    size_t size() const
+    {
+      return _size;
+    }
+
+    size_t num_tokens() const
+    {
+      return _num_tokens;
+    }
+
+    std::string text() const;
+    // Sets batch to the tokens of the text, as returned by Tokenizer::tokenize.
+    void get_tokens(TokenBatch& batch) const;
+
+  private:
+    struct Block
+    {
+      std::string text;
+      TokenBatch tokens;
+      Tokenizer::KernelRegisters registers;  // Before the first token.
+    };
+
+    // Node of a treap ordered by position in the text, with the size and number of
+    // tokens of its subtree.
+    struct Node;
+    typedef std::unique_ptr<Node> Tree;
+
+    const Tokenizer& _tokenizer;
+    Workspace _workspace;
+    Tree _blocks;
+    std::minstd_rand _random;
+    size_t _size;
+    size_t _num_tokens;
+
+    // Tokenizes text in blocks of at least min_block_size bytes, starting with
+    // registers, and returns them. Ends when text is tokenized and the first block of
+    // next starts with the resulting state, moving the blocks of next that are tokenized
+    // again to the text. Nodes are taken from stale before new ones are allocated.
+    Tree tokenize_blocks(std::string& text,
+                         Tokenizer::KernelRegisters registers,
+                         Tree& next,
+                         std::vector<Tree>& stale);
+    Tree new_node(std::vector<Tree>& stale);
+    // Sets the block of a node without children to text, tokenized from registers.
+    void set_block(Node& node, StringView text, Tokenizer::KernelRegisters& registers);
+
+    static void update(Node& node);
+    static Tree merge(Tree left, Tree right);
+    // Moves the first blocks of tree for which before(block, offset) is true to left,
+    // and the others to right. offset is the position of the block in the text, tree
+    // starting at begin.
+    template <typename Predicate>
+    static void split(Tree tree, size_t begin, Predicate before, Tree& left, Tree& right);
+    static Tree pop_front(Tree& tree);
+    static Tree pop_back(Tree& tree);
+    // Moves the nodes of tree to nodes, in order.
+    static void flatten(Tree tree, std::vector<Tree>& nodes);
+    template <typename Function>
+    static void for_each_block(const Node* node, Function function);
+  };
+
+}
@@ -1,14 +1,24 @@
 #pragma once
 
+#include <memory>
 #include <unordered_map>
+#include <unordered_set>
 
 #include "onmt/ITokenizer.h"
 #include "onmt/BPE.h"
+#include "onmt/StringView.h"
+#include "onmt/Vocabulary.h"
+#include "onmt/Workspace.h"
 
 namespace onmt
 {
 
   // This Tokenizer implements the behaviour of OpenNMT's tools/tokenize.lua.
+  //
+  // Tokenization and detokenization are const and do not modify the instance: a
+  // configured Tokenizer can be shared by several threads, each using its own
+  // Workspace. Copies share the same BPE model; the setters below should only be
+  // called before the instance is shared, e.g. on a copy.
   class Tokenizer: public ITokenizer
   {
   public:
@@ -28,7 +38,12 @@ namespace onmt
       WithSeparators = 8,
       SegmentCase = 16,
       SegmentNumbers = 32,
-      CacheBPEModel = 64
+      CacheBPEModel = 64,
+      SkipInvalidUtf8 = 128,
+      ThrowOnInvalidUtf8 = 256,
+      NormalizeNFC = 512,
+      NormalizeNFKC = 1024,
+      SegmentAlphabetChange = 2048
     };
 
     static const std::string joiner_marker;
@@ -41,19 +56,72 @@ namespace onmt
               int flags = Flags::None,
               const std::string& bpe_model_path = "",
               const std::string& joiner = joiner_marker);
-    ~Tokenizer();
+
+    using ITokenizer::tokenize;
+    using ITokenizer::detokenize;
 
     void tokenize(const std::string& text,
                   std::vector<std::string>& words,
-                  std::vector<std::vector<std::string> >& features) override;
+                  std::vector<std::vector<std::string> >& features) const override;
+    void tokenize(const std::string& text, TokenBatch& batch) const override;
+    void tokenize(const std::string& text, TokenBatch& batch, Workspace& workspace) const;
+    // Tokenizes a large text on up to num_threads threads, e.g. a whole book. The text is
+    // split in parts where the tokenization state is reset, and the tokens are the same
+    // as with a single thread. Texts smaller than 64 KB per thread use fewer threads.
+    void tokenize(const std::string& text, TokenBatch& batch, size_t num_threads) const;
+    // Tokenizes into at most max_tokens tokens, including BPE subwords, and stops as soon
+    // as they are produced: the text is validated, normalized and tokenized by parts, so
+    // the cost depends on max_tokens and not on the size of text. Returns
+    // std::string::npos if no token was left out, or the position in text after the last
+    // word with all its tokens in batch. With normalization, a position inside the
+    // normalized form of characters is moved before them. ThrowOnInvalidUtf8 only
+    // reports invalid UTF-8 in the parts that are read.
+    size_t tokenize(const std::string& text,
+                    TokenBatch& batch,
+                    Workspace& workspace,
+                    size_t max_tokens) const;
+
+    // Returns the number of tokens of text, including BPE subwords and joiners given as
+    // tokens, without building them.
+    size_t count_tokens(const std::string& text) const;
+    size_t count_tokens(const std::string& text, Workspace& workspace) const;
+
+    // Sets ids to the vocabulary IDs of the tokens, without building the tokens. With the
+    // case feature, the case of each token is set in case_feature if it is not null. The
+    // features of space mode are not returned.
+    void tokenize(const std::string& text,
+                  std::vector<int32_t>& ids,
+                  const Vocabulary& vocabulary,
+                  Workspace& workspace,
+                  std::vector<CaseModifier::Type>* case_feature = nullptr) const;
+
+    // Tokenizes without copying: tokens are returned as ranges of text, which must be
+    // valid UTF-8. Only the segmentation is applied: normalization, BPE and case feature
+    // are not. In space mode, the joiners at the edges of a token are given as flags,
+    // unless BPE segments the whole token.
+    void tokenize(StringView text, std::vector<TokenSpan>& spans) const;
+    // Returns the text of a token, without joiners.
+    static std::string get_token_text(StringView text, const TokenSpan& span);
 
     std::string detokenize(const std::vector<std::string>& words,
-                           const std::vector<std::vector<std::string> >& features) override;
+                           const std::vector<std::vector<std::string> >& features) const override;
+    std::string detokenize(const TokenBatch& batch) const override;
+    // Detokenizes into text, reusing its memory. Tokens are joined according to the
+    // joiner flags of the batch, and tokens equal to the joiner (JoinerNew).
+    void detokenize(const TokenBatch& batch, std::string& text) const;
+    // Appends token i of batch to text with its joiners, as in the tokens of the string
+    // API.
+    void append_token(const TokenBatch& batch, size_t i, std::string& text) const;
 
     Tokenizer& set_joiner(const std::string& joiner);
     Tokenizer& set_bpe_model(const std::string& model_path, bool cache_model = false);
+    // Segment each letter of this alphabet, given as a Unicode script name (e.g. "Han").
+    Tokenizer& add_alphabet_to_segment(const std::string& alphabet);
 
   private:
+    friend class StreamTokenizer;
+    friend class TokenizedText;
+
     Mode _mode;
 
     bool _case_feature;
@@ -62,15 +130,99 @@ namespace onmt
     bool _with_separators;
     bool _segment_case;
     bool _segment_numbers;
-    bool _cache_bpe_model;
+    bool _skip_invalid_utf8;
+    bool _throw_on_invalid_utf8;
+    bool _normalize_nfc;
+    bool _normalize_nfkc;
+    bool _segment_alphabet_change;
 
-    BPE* _bpe;
+    std::shared_ptr<const BPE> _bpe;
     std::string _joiner;
+    std::unordered_set<int> _segment_alphabet;
 
-    std::vector<std::string> bpe_segment(const std::vector<std::string>& tokens);
+    // Registers of the tokenization kernel that are not reset by separators. A text
+    // split after separators is tokenized as a whole when they are carried from one part
+    // to the next. They start at zero.
+    struct KernelRegisters
+    {
+      int type_letter;
+      int prev_script;
+    };
 
-    bool has_left_join(const std::string& word);
-    bool has_right_join(const std::string& word);
+    unicode::InvalidUtf8 get_invalid_utf8_policy() const;
+    unicode::NormalizationForm get_normalization_form() const;
+    // Returns text, or its sanitized and normalized form stored in workspace.
+    StringView prepare_text(StringView text, Workspace& workspace) const;
+    // Returns the position in text of the position offset in input, as returned by
+    // prepare_text(text, workspace).
+    size_t get_text_offset(StringView text,
+                           StringView input,
+                           size_t offset,
+                           Workspace& workspace) const;
+    // Returns the position after the word of the token ending at end.
+    size_t get_word_end(StringView text, size_t end) const;
+    // Adds the tokens of text to sink, stopping once it holds max_tokens tokens. Returns
+    // the position after the last word with all its tokens in sink, or text.size() if
+    // no token was left out.
+    template <typename Sink>
+    size_t tokenize_into(StringView text,
+                         Sink& sink,
+                         Workspace& workspace,
+                         KernelRegisters* registers = nullptr,
+                         size_t max_tokens = std::string::npos) const;
+    // Appends the tokens of a part of a text to batch (see KernelRegisters).
+    void tokenize_part(StringView text,
+                       TokenBatch& batch,
+                       Workspace& workspace,
+                       KernelRegisters& registers) const;
+
+    // Search for the positions where a text can be split into parts that are tokenized
+    // separately: the offset of the next character to scan and the state at this offset.
+    struct SplitSearch
+    {
+      size_t offset;
+      bool in_placeholder;
+      bool after_separator;
+    };
+    // Returns the next position where text can be split, or std::string::npos once the
+    // end of text is reached. The search stops before a final sequence that may be
+    // incomplete.
+    size_t find_split(StringView text, SplitSearch& search) const;
+    // Returns the first position from offset where text can be split and where no
+    // state is carried to the next part, or text.size().
+    size_t find_reset_split(StringView text, size_t offset) const;
+
+    // offset is the position of word in the tokenized text, or std::string::npos if word
+    // is not a range of the text.
+    template <typename Sink>
+    void add_word(StringView word,
+                  size_t offset,
+                  bool join_left,
+                  bool join_right,
+                  Sink& sink,
+                  Workspace& workspace) const;
+    // lowercase and letters describe the case of token as stored in Workspace, and are
+    // computed from token when they do not have its size. The joiners are only added by
+    // the sink.
+    template <typename Sink>
+    void add_token(StringView token,
+                   StringView lowercase,
+                   StringView letters,
+                   bool join_left,
+                   bool join_right,
+                   Sink& sink,
+                   Workspace& workspace) const;
+
+    void tokenize_text(StringView text,
+                       std::vector<TokenSpan>& spans,
+                       Workspace* workspace,
+                       KernelRegisters* registers,
+                       size_t max_spans) const;
+
+    TokenSpan get_space_token_span(StringView text, StringView token) const;
+
+    bool has_left_join(StringView word) const;
+    bool has_right_join(StringView word) const;
   };
 
 }
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "onmt/StringView.h"
+
+namespace onmt
+{
+
+  // Maps tokens to integer IDs, their position in the vocabulary. Tokens are stored in a
+  // single buffer indexed by an open addressing hash table, and can be looked up in
+  // pieces (e.g. a subword and its joiners) without joining them.
+  class Vocabulary
+  {
+  public:
+    // Loads a file with one token per line, optionally followed by a space or a
+    // tabulation and other fields (e.g. its frequency) that are ignored.
+    Vocabulary(const std::string& path, const std::string& unknown_token = "<unk>");
+    Vocabulary(const std::vector<std::string>& tokens,
+               const std::string& unknown_token = "<unk>");
+
+    // Returns the ID of the token made of left, token and right, or unknown_id().
+    int32_t lookup(StringView token) const;
+    int32_t lookup(StringView left, StringView token, StringView right) const;
+
+    // ID of the unknown token, added after the other tokens if it is not one of them.
+    int32_t unknown_id() const
+    {
+      return _unknown_id;
+    }
+
+    size_t size() const
+    {
+      return _offsets.size() - 1;
+    }
+
+    StringView token(int32_t id) const
+    {
+      return StringView(_tokens.data() + _offsets[id], _offsets[id + 1] - _offsets[id]);
+    }
+
+  private:
+    std::string _tokens;
+    std::vector<uint32_t> _offsets;  // Of each token in _tokens, and of its end.
+    std::vector<int32_t> _slots;  // IDs, or -1 for empty slots.
+    int32_t _unknown_id;
+
+    void add_token(StringView token);
+    void build(const std::string& unknown_token);
+    size_t find_slot(StringView left, StringView token, StringView right) const;
+  };
+
+}
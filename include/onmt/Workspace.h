@@ -0,0 +1,59 @@
+#pragma once
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "onmt/StringView.h"
+#include "onmt/TokenBatch.h"
+#include "onmt/unicode/Unicode.h"
+
+namespace onmt
+{
+
+  // Scratch buffers reused across calls. Once the buffers have grown, tokenizing valid
+  // text into a TokenBatch does not allocate, also when it is normalized. A workspace must not be
+  // used by several calls at the same time, e.g. use one per thread.
+  class Workspace
+  {
+  private:
+    friend class BPE;
+    friend class Tokenizer;
+
+    // Text after replacement of invalid UTF-8 sequences, then after normalization with
+    // the scratch buffer of normalization.
+    std::string _text;
+    std::string _normalized;
+    std::vector<unicode::code_point_t> _normalized_code_points;
+    std::vector<TokenSpan> _spans;
+    std::string _token;
+    std::string _piece;
+    std::string _lowercase;
+
+    // Case feature: the lowercase form of a string and, for each of its bytes, the
+    // unicode::_type_letter of the letter starting at this byte (0 otherwise). Computed
+    // for the text during tokenization, then sliced for tokens, BPE pieces and joiners.
+    std::string _case_text;
+    std::string _case_text_letters;
+    std::string _case_joiner;
+    std::string _case_joiner_letters;
+
+    // Code point of each character of the text, at the offset of its first byte. Recorded
+    // during tokenization for BPE.
+    std::vector<unicode::code_point_t> _code_points;
+
+    // BPE: the characters of the word as offsets and code points, and its symbols as
+    // ranges of characters (and markers) with their identifier in the model.
+    struct BPESymbol
+    {
+      int id;
+      size_t begin;
+      size_t end;
+    };
+    std::vector<std::pair<size_t, unicode::code_point_t> > _bpe_chars;
+    std::vector<BPESymbol> _bpe_symbols;
+    std::vector<BPESymbol> _bpe_merged;
+    std::vector<StringView> _bpe_pieces;
+  };
+
+}
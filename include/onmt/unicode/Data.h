@@ -7,13 +7,95 @@ namespace onmt
   namespace unicode
   {
 
-    extern const map_of_list_t unidata_Number;
-    extern const map_of_list_t unidata_LetterUpper;
-    extern const map_of_list_t unidata_LetterLower;
-    extern const map_of_list_t unidata_LetterOther;
-    extern const map_of_list_t unidata_Separator;
-    extern const map_of_list_t unidata_Mark;
-    extern const map_unicode map_lower;
+    // Character properties are stored in a two-stage table: the high bits of a
+    // code point select a block in properties_index and the low bits the entry
+    // in this block of properties_blocks.
+    const unsigned int properties_block_bits = 7;
+
+    extern const uint16_t properties_index[];
+    extern const unsigned char properties_blocks[];
+
+    // Case mappings: characters below 0x100 are directly mapped by the *_latin1
+    // arrays (0 if there is no mapping). Other characters up to case_max_code_point
+    // use a two-stage table storing the difference between the mapped and the
+    // original code point.
+    const unsigned int case_block_bits = 7;
+
+    extern const code_point_t case_max_code_point;
+
+    extern const uint16_t lower_latin1[];
+    extern const uint16_t lower_index[];
+    extern const int32_t lower_blocks[];
+
+    extern const uint16_t upper_latin1[];
+    extern const uint16_t upper_index[];
+    extern const int32_t upper_blocks[];
+
+    // Normalization properties use a two-stage table like character properties. The
+    // low byte of an entry is the canonical combining class and the high byte a
+    // combination of _normalization_property values.
+    const unsigned int normalization_block_bits = 7;
+
+    enum _normalization_property
+    {
+      _norm_nfc_no = 1 << 8,
+      _norm_nfc_maybe = 1 << 9,
+      _norm_nfkc_no = 1 << 10,
+      _norm_nfkc_maybe = 1 << 11,
+      _norm_canonical_decomposition = 1 << 12,
+      _norm_compatibility_decomposition = 1 << 13
+    };
+
+    extern const uint16_t normalization_index[];
+    extern const uint16_t normalization_blocks[];
+
+    // Full decompositions of the characters flagged with _norm_compatibility_decomposition,
+    // sorted by code point. The canonical decomposition starts at offset in
+    // decomposition_code_points and is followed by the compatibility decomposition.
+    // Hangul syllables are decomposed algorithmically.
+    struct Decomposition
+    {
+      code_point_t code_point;
+      uint16_t offset;
+      uint8_t canonical_length;
+      uint8_t compatibility_length;
+    };
+
+    extern const Decomposition decompositions[];
+    extern const size_t decompositions_size;
+    extern const code_point_t decomposition_code_points[];
+
+    // Primary composites, sorted by first and second character.
+    struct Composition
+    {
+      code_point_t first;
+      code_point_t second;
+      code_point_t composite;
+    };
+
+    extern const Composition compositions[];
+    extern const size_t compositions_size;
+
+    // Scripts use a two-stage table like character properties. Entries are indices
+    // in script_names.
+    const unsigned int script_block_bits = 7;
+
+    extern const uint16_t script_index[];
+    extern const unsigned char script_blocks[];
+    extern const char* const script_names[];
+    extern const size_t scripts_size;
+
+    // Hangul syllables are composed of a leading consonant, a vowel and an optional
+    // trailing consonant (Unicode Standard, section 3.12).
+    const code_point_t hangul_s_base = 0xAC00;
+    const code_point_t hangul_l_base = 0x1100;
+    const code_point_t hangul_v_base = 0x1161;
+    const code_point_t hangul_t_base = 0x11A7;
+    const code_point_t hangul_l_count = 19;
+    const code_point_t hangul_v_count = 21;
+    const code_point_t hangul_t_count = 28;
+    const code_point_t hangul_n_count = hangul_v_count * hangul_t_count;
+    const code_point_t hangul_s_count = hangul_l_count * hangul_n_count;
 
   }
 }
@@ -1,29 +1,238 @@
 #pragma once
 
 #include <cstdint>
-#include <map>
-#include <unordered_map>
 #include <vector>
 #include <string>
 
+#include "onmt/StringView.h"
+
 namespace onmt
 {
   namespace unicode
   {
 
     typedef uint32_t code_point_t;
-    typedef std::map<code_point_t, std::vector<code_point_t> > map_of_list_t;
-    typedef std::unordered_map<code_point_t, code_point_t> map_unicode;
 
     std::string cp_to_utf8(code_point_t u);
     code_point_t utf8_to_cp(const unsigned char* s, unsigned int &l);
 
-    std::vector<std::string> split_utf8(const std::string& str, const std::string& sep);
-    void explode_utf8(std::string str,
+    // Returns the length of the well-formed sequence starting at s (Unicode Table 3-7),
+    // or 0 if it is ill-formed or incomplete.
+    inline unsigned int utf8_sequence_length(const unsigned char* s, size_t size)
+    {
+      const unsigned char c = s[0];
+      if (c < 0x80)
+        return 1;
+      if (c < 0xC2)
+        return 0;
+      if (c < 0xE0)
+        return size >= 2 && (s[1] & 0xC0) == 0x80 ? 2 : 0;
+      if (c < 0xF0)
+      {
+        if (size < 3 || (s[1] & 0xC0) != 0x80 || (s[2] & 0xC0) != 0x80)
+          return 0;
+        if ((c == 0xE0 && s[1] < 0xA0) || (c == 0xED && s[1] > 0x9F))
+          return 0;
+        return 3;
+      }
+      if (c < 0xF5)
+      {
+        if (size < 4
+            || (s[1] & 0xC0) != 0x80 || (s[2] & 0xC0) != 0x80 || (s[3] & 0xC0) != 0x80)
+          return 0;
+        if ((c == 0xF0 && s[1] < 0x90) || (c == 0xF4 && s[1] > 0x8F))
+          return 0;
+        return 4;
+      }
+      return 0;
+    }
+
+    // Same as above but reads at most size bytes. l is set to 0 if the sequence
+    // is incomplete or ill-formed, and no byte after it is read.
+    inline code_point_t utf8_to_cp(const unsigned char* s, size_t size, unsigned int &l)
+    {
+      l = utf8_sequence_length(s, size);
+      switch (l)
+      {
+      case 1:
+        return s[0];
+      case 2:
+        return ((s[0] & 0x1f) << 6) + ((s[1] & 0x3f));
+      case 3:
+        return ((s[0] & 0x0f) << 12) + ((s[1] & 0x3f) << 6) + ((s[2] & 0x3f));
+      case 4:
+        return (((s[0] & 0x07) << 18) + ((s[1] & 0x3f) << 12) + ((s[2] & 0x3f) << 6)
+                + ((s[3] & 0x3f)));
+      default:
+        return 0;
+      }
+    }
+
+    // Character of a UTF-8 string, as decoded by Utf8Iterator.
+    struct Utf8Char
+    {
+      code_point_t code_point;
+      size_t offset;        // Position of the first byte in the string.
+      unsigned int length;  // Number of bytes.
+    };
+
+    // Decodes the characters of a UTF-8 string without copying or allocating.
+    // Each byte of an invalid sequence is returned as the code point 0.
+    class Utf8Iterator
+    {
+    public:
+      Utf8Iterator(const char* data, size_t size, size_t offset)
+        : _data(reinterpret_cast<const unsigned char*>(data))
+        , _size(size)
+      {
+        _char.offset = offset;
+        decode();
+      }
+
+      const Utf8Char& operator*() const
+      {
+        return _char;
+      }
+
+      const Utf8Char* operator->() const
+      {
+        return &_char;
+      }
+
+      Utf8Iterator& operator++()
+      {
+        _char.offset += _char.length;
+        decode();
+        return *this;
+      }
+
+      Utf8Iterator operator++(int)
+      {
+        Utf8Iterator it(*this);
+        ++*this;
+        return it;
+      }
+
+      bool operator==(const Utf8Iterator& other) const
+      {
+        return _char.offset == other._char.offset;
+      }
+
+      bool operator!=(const Utf8Iterator& other) const
+      {
+        return _char.offset != other._char.offset;
+      }
+
+    private:
+      const unsigned char* _data;
+      size_t _size;
+      Utf8Char _char;
+
+      void decode()
+      {
+        if (_char.offset >= _size)
+        {
+          _char.code_point = 0;
+          _char.length = 0;
+          return;
+        }
+
+        _char.code_point = utf8_to_cp(_data + _char.offset, _size - _char.offset, _char.length);
+        if (_char.length == 0)
+          _char.length = 1;
+      }
+    };
+
+    // Range of the characters of a UTF-8 string, e.g. for use in range-based for loops.
+    // The string must outlive the range.
+    class Utf8Range
+    {
+    public:
+      Utf8Range(const char* data, size_t size)
+        : _data(data)
+        , _size(size)
+      {
+      }
+
+      explicit Utf8Range(const std::string& str)
+        : _data(str.data())
+        , _size(str.size())
+      {
+      }
+
+      Utf8Iterator begin() const
+      {
+        return Utf8Iterator(_data, _size, 0);
+      }
+
+      Utf8Iterator end() const
+      {
+        return Utf8Iterator(_data, _size, _size);
+      }
+
+    private:
+      const char* _data;
+      size_t _size;
+    };
+
+    // Splits str on each occurrence of sep. The fragments point into str.
+    std::vector<StringView> split_utf8(StringView str, StringView sep);
+    void explode_utf8(const std::string& str,
                       std::vector<std::string>& chars,
                       std::vector<code_point_t>& code_points);
 
-    size_t utf8len(std::string str);
+    // Number of characters in a valid UTF-8 string.
+    size_t utf8len(StringView str);
+
+    // How to handle ill-formed UTF-8 sequences.
+    enum class InvalidUtf8
+    {
+      Replace,  // Replace each maximal ill-formed subpart by U+FFFD.
+      Skip,     // Remove the ill-formed bytes.
+      Throw     // Throw std::invalid_argument.
+    };
+
+    // Returns the offset of the first ill-formed sequence, or size if data is valid.
+    // Uses SSE4.1 or AVX2 when the CPU supports them.
+    size_t validate_utf8(const char* data, size_t size);
+    std::string sanitize_utf8(StringView str, InvalidUtf8 policy);
+    // Returns the position in str of the position offset in sanitize_utf8(str, policy).
+    // A position in a replacement character is moved before the ill-formed sequence.
+    size_t get_unsanitized_offset(StringView str, InvalidUtf8 policy, size_t offset);
+    inline unsigned int utf8_sequence_length(const char* data, size_t size)
+    {
+      return utf8_sequence_length(reinterpret_cast<const unsigned char*>(data), size);
+    }
+
+    // Returns the offset of the first non-ASCII byte at or after offset, or size.
+    size_t skip_ascii(const char* data, size_t size, size_t offset);
+    // Returns the offset of the first byte at or after offset that is not an ASCII
+    // character above the space (0x21 to 0x7F), or size.
+    size_t skip_ascii_non_space(const char* data, size_t size, size_t offset);
+
+    enum class NormalizationForm
+    {
+      NFC,
+      NFKC
+    };
+
+    // Normalizes str and returns true, or returns false if str is already normalized.
+    // Normalized text is usually detected by the quick check with a single scan.
+    bool normalize(StringView str, NormalizationForm form, std::string& normalized);
+    // Same reusing the memory of normalized and code_points, which is used as scratch
+    // buffer. normalized is unspecified when false is returned.
+    bool normalize(StringView str,
+                   NormalizationForm form,
+                   std::string& normalized,
+                   std::vector<code_point_t>& code_points);
+    // Returns the position in str, which must be valid UTF-8, of the position offset in
+    // its normalized form. A position inside the normalized form of characters that
+    // are composed or reordered together is moved before them. code_points is used as
+    // scratch buffer.
+    size_t get_unnormalized_offset(StringView str,
+                                   NormalizationForm form,
+                                   size_t offset,
+                                   std::vector<code_point_t>& code_points);
 
     enum _type_letter
     {
@@ -32,6 +241,20 @@ namespace onmt
       _letter_upper
     };
 
+    // Character properties, as returned by get_properties. A letter that is
+    // neither lowercase nor uppercase is of type _letter_other.
+    enum _char_property
+    {
+      _prop_separator = 1 << 0,
+      _prop_letter = 1 << 1,
+      _prop_letter_lower = 1 << 2,
+      _prop_letter_upper = 1 << 3,
+      _prop_number = 1 << 4,
+      _prop_mark = 1 << 5
+    };
+
+    unsigned char get_properties(code_point_t u);
+
     bool is_separator(code_point_t u);
     bool is_letter(code_point_t u, _type_letter &tl);
     bool is_number(code_point_t u);
@@ -40,5 +263,19 @@ namespace onmt
     code_point_t get_upper(code_point_t u);
     code_point_t get_lower(code_point_t u);
 
+    // Script identifiers, as returned by get_script. Other scripts have identifiers
+    // above _script_inherited that are resolved by name with get_script_id.
+    enum _script
+    {
+      _script_unknown = 0,
+      _script_common = 1,      // Punctuation, digits, symbols, etc.
+      _script_inherited = 2    // Combining marks that take the script of the base character.
+    };
+
+    int get_script(code_point_t u);
+    // Returns the identifier of a script from its Unicode name (e.g. "Latin", "Han"),
+    // or -1 if the name is unknown.
+    int get_script_id(const std::string& name);
+
   }
 }
@@ -9,15 +9,9 @@
 namespace onmt
 {
 
-  static std::vector<std::pair<std::string, std::string> >
-  get_pairs(const std::vector<std::string>& chars)
+  static uint64_t get_pair_key(int first, int second)
   {
-    std::vector<std::pair<std::string, std::string> > pairs;
-
-    for (size_t i = 0; i < chars.size() - 1; ++i)
-      pairs.emplace_back(chars[i], chars[i + 1]);
-
-    return pairs;
+    return (static_cast<uint64_t>(static_cast<uint32_t>(first)) << 32) | static_cast<uint32_t>(second);
   }
 
   BPE::BPE(const std::string& model_path)
@@ -66,152 +60,222 @@ namespace onmt
       size_t sep = line.find(' ');
       if (sep != std::string::npos && sep + 1 < line.size())
       {
-        auto data = std::make_pair(line.substr(0, sep), line.substr(sep + 1));
-        if (_codes.count(data) == 0)
-          _codes[data] = i++;
+        // A pair listed several times keeps the rank of its first line.
+        const std::string first = line.substr(0, sep);
+        const std::string second = line.substr(sep + 1);
+        const uint64_t key = get_pair_key(add_symbol(first), add_symbol(second));
+        if (_merges.find(key) == _merges.end())
+          _merges[key] = Merge{i++, add_symbol(first + second)};
       }
     }
+
+    for (size_t c = 0; c < 128; ++c)
+      _ascii_symbols[c] = -1;
+    for (const auto& symbol: _symbols)
+    {
+      unicode::Utf8Range chars(symbol.first.data(), symbol.first.size());
+      if (chars.begin() == chars.end() || ++chars.begin() != chars.end())
+        continue;
+      const unicode::code_point_t c = chars.begin()->code_point;
+      if (c < 128)
+        _ascii_symbols[c] = symbol.second;
+      else
+        _char_symbols[c] = symbol.second;
+    }
+
+    _begin_of_word_symbol = get_symbol(_begin_of_word);
+    _end_of_word_symbol = get_symbol(_end_of_word);
   }
 
-  std::vector<std::string> BPE::encode(const std::string& str) const
+  int BPE::add_symbol(const std::string& symbol)
+  {
+    return _symbols.insert(std::make_pair(symbol, static_cast<int>(_symbols.size()))).first->second;
+  }
+
+  int BPE::get_symbol(const std::string& symbol) const
+  {
+    auto it = _symbols.find(symbol);
+    return it == _symbols.end() ? -1 : it->second;
+  }
+
+  int BPE::get_char_symbol(unicode::code_point_t c) const
   {
-    std::string str_lc = str;
     if (_case_insensitive)
     {
-      str_lc = CaseModifier::extract_case(str).first;
+      unicode::code_point_t lower = unicode::get_lower(c);
+      if (lower)
+        c = lower;
     }
+    if (c < 128)
+      return _ascii_symbols[c];
+    auto it = _char_symbols.find(c);
+    return it == _char_symbols.end() ? -1 : it->second;
+  }
+
+  std::vector<std::string> BPE::encode(const std::string& str) const
+  {
+    Workspace workspace;
+    std::vector<StringView> pieces;
+    encode(str, pieces, workspace);
 
     std::vector<std::string> chars;
-    std::vector<unicode::code_point_t> code_points;
+    for (const auto& piece: pieces)
+      chars.push_back(piece.to_string());
+    return chars;
+  }
 
-    unicode::explode_utf8(str_lc, chars, code_points);
+  void BPE::encode(StringView str, std::vector<StringView>& pieces, Workspace& workspace) const
+  {
+    workspace._bpe_chars.clear();
+    for (const auto& c: unicode::Utf8Range(str.data(), str.size()))
+      workspace._bpe_chars.emplace_back(c.offset, c.code_point);
+    encode_chars(str, pieces, workspace);
+  }
+
+  void BPE::encode(StringView str,
+                   const unicode::code_point_t* code_points,
+                   std::vector<StringView>& pieces,
+                   Workspace& workspace) const
+  {
+    workspace._bpe_chars.clear();
+    for (size_t i = 0; i < str.size(); ++i)
+    {
+      if ((static_cast<unsigned char>(str[i]) & 0xC0) != 0x80)
+        workspace._bpe_chars.emplace_back(i, code_points[i]);
+    }
+    encode_chars(str, pieces, workspace);
+  }
 
-    if (chars.size() == 1)
+  void BPE::encode_chars(StringView str,
+                         std::vector<StringView>& pieces,
+                         Workspace& workspace) const
+  {
+    const std::vector<std::pair<size_t, unicode::code_point_t> >& chars = workspace._bpe_chars;
+    if (chars.size() <= 1)
     {
-      chars[0] = str;
-      return chars;
+      pieces.push_back(str);
+      return;
     }
 
-    if (_prefix) { chars.insert(chars.begin(), _begin_of_word); }
-    if (_suffix) { chars.push_back(_end_of_word); }
+    // Symbols are ranges of positions: the characters surrounded by the markers. Merging
+    // two adjacent symbols joins their ranges.
+    std::vector<Workspace::BPESymbol>& symbols = workspace._bpe_symbols;
+    symbols.clear();
+    if (_prefix)
+      symbols.push_back(Workspace::BPESymbol{_begin_of_word_symbol, 0, 1});
+    const size_t first_char = symbols.size();
+    for (const auto& c: chars)
+    {
+      const size_t position = symbols.size();
+      symbols.push_back(Workspace::BPESymbol{get_char_symbol(c.second), position, position + 1});
+    }
+    const size_t end_char = symbols.size();
+    if (_suffix)
+      symbols.push_back(Workspace::BPESymbol{_end_of_word_symbol, end_char, end_char + 1});
 
-    auto pairs = get_pairs(chars);
+    std::vector<Workspace::BPESymbol>& merged = workspace._bpe_merged;
 
     while (true)
     {
-      auto bigram = get_min_pair(pairs);
+      Merge merge;
+      int min_pair = get_min_pair(symbols, merge);
 
-      if (bigram.first.empty())
+      if (min_pair < 0)
         break;
 
-      std::vector<std::string> new_chars;
-      bool merge = false;
+      const int first = symbols[min_pair].id;
+      const int second = symbols[min_pair + 1].id;
+      merged.clear();
+      bool merging = false;
+      size_t pending = 0;
 
-      for (size_t i = 0; i < chars.size(); ++i)
+      for (size_t i = 0; i < symbols.size(); ++i)
       {
-        if (merge)
+        const int symbol = symbols[i].id;
+        if (merging)
         {
-          if (chars[i] == bigram.second)
+          if (symbol == second)
           {
-            new_chars.push_back(bigram.first + bigram.second);
-            merge = false;
+            merged.push_back(Workspace::BPESymbol{merge.symbol,
+                                                  symbols[pending].begin,
+                                                  symbols[i].end});
+            merging = false;
           }
-          else if (chars[i] == bigram.first)
+          else if (symbol == first)
           {
-            new_chars.push_back(bigram.first);
+            merged.push_back(symbols[pending]);
+            pending = i;
           }
           else
           {
-            new_chars.push_back(bigram.first);
-            new_chars.push_back(chars[i]);
-            merge = false;
+            merged.push_back(symbols[pending]);
+            merged.push_back(symbols[i]);
+            merging = false;
           }
         }
         else
         {
-          if (chars[i] == bigram.first)
-            merge = true;
+          if (symbol == first)
+          {
+            merging = true;
+            pending = i;
+          }
           else
-            new_chars.push_back(chars[i]);
+            merged.push_back(symbols[i]);
         }
       }
 
-      chars.swap(new_chars);
-      if (chars.size() == 1)
+      symbols.swap(merged);
+      if (symbols.size() == 1)
         break;
-      else
-        pairs = get_pairs(chars);
     }
 
     if (_prefix)
     {
-      if (chars.front() == _begin_of_word)
-        chars.erase(chars.begin());
-      else if (chars.front().substr(0, _begin_of_word.size()) == _begin_of_word)
-      {
-        std::string cleaned = chars.front().substr(_begin_of_word.size());
-        chars.erase(chars.begin());
-        chars.insert(chars.begin(), cleaned);
-      }
+      if (symbols.front().end == first_char)
+        symbols.erase(symbols.begin());
+      else
+        symbols.front().begin = first_char;
     }
 
     if (_suffix)
     {
-      if (chars.back() == _end_of_word)
-        chars.pop_back();
-      else if (chars.back().substr(chars.back().size() - _end_of_word.size()) == _end_of_word)
-      {
-        std::string cleaned = chars.back().substr(0, chars.back().size() - _end_of_word.size());
-        chars.pop_back();
-        chars.push_back(cleaned);
-      }
+      if (symbols.back().begin == end_char)
+        symbols.pop_back();
+      else
+        symbols.back().end = end_char;
     }
 
-    if (_case_insensitive)
+    for (const auto& symbol: symbols)
     {
-      std::vector<std::string> word_tc;
-
-      std::vector<std::string> chars_tc;
-      std::vector<unicode::code_point_t> code_points_tc;
-
-      unicode::explode_utf8(str, chars_tc, code_points_tc);
-
-      std::vector<std::string>::iterator it = chars_tc.begin();
-      for (size_t i = 0; i < chars.size(); ++i)
-      {
-        size_t curr_length = unicode::utf8len(chars[i]);
-        std::string curr_str;
-        std::vector<std::string>::iterator it_end = it + curr_length;
-        while (it != it_end)
-        {
-          curr_str += *it;
-          it++;
-        }
-        word_tc.push_back(curr_str);
-      }
-      chars.swap(word_tc);
+      const size_t begin = chars[symbol.begin - first_char].first;
+      const size_t end = (symbol.end == end_char
+                          ? str.size()
+                          : chars[symbol.end - first_char].first);
+      pieces.push_back(str.substr(begin, end - begin));
     }
-
-    return chars;
   }
 
-  std::pair<std::string, std::string>
-  BPE::get_min_pair(const std::vector<std::pair<std::string, std::string> >& pairs) const
+  int BPE::get_min_pair(const std::vector<Workspace::BPESymbol>& symbols, Merge& merge) const
   {
     int min_score = std::numeric_limits<int>::max();
-    std::pair<std::string, std::string> min_pair;
+    int min_pair = -1;
 
-    for (size_t i = 0; i < pairs.size(); ++i)
+    for (size_t i = 0; i + 1 < symbols.size(); ++i)
     {
-      auto it = _codes.find(pairs[i]);
+      if (symbols[i].id < 0 || symbols[i + 1].id < 0)
+        continue;
+
+      auto it = _merges.find(get_pair_key(symbols[i].id, symbols[i + 1].id));
 
-      if (it != _codes.end())
+      if (it != _merges.end())
       {
-        int score = it->second;
+        int score = it->second.rank;
         if (score < min_score)
         {
           min_score = score;
-          min_pair = pairs[i];
+          min_pair = i;
+          merge = it->second;
         }
       }
     }
@@ -5,7 +5,7 @@
 namespace onmt
 {
 
-  static CaseModifier::Type update_type(CaseModifier::Type current, unicode::_type_letter type)
+  CaseModifier::Type CaseModifier::update_case(Type current, unicode::_type_letter type)
   {
     switch (current)
     {
@@ -40,65 +40,74 @@ namespace onmt
     return current;
   }
 
-
   std::pair<std::string, char> CaseModifier::extract_case(const std::string& token)
   {
-    std::vector<std::string> chars;
-    std::vector<unicode::code_point_t> code_points;
-
-    unicode::explode_utf8(token, chars, code_points);
+    std::string new_token;
+    new_token.reserve(token.size());
+    Type current_case = extract_case(token, new_token);
+    return std::make_pair(new_token, type_to_char(current_case));
+  }
 
+  CaseModifier::Type CaseModifier::extract_case(StringView token, std::string& output)
+  {
     Type current_case = Type::None;
-    std::string new_token;
 
-    for (size_t i = 0; i < chars.size(); ++i)
+    for (const auto& c: unicode::Utf8Range(token.data(), token.size()))
     {
-      unicode::code_point_t v = code_points[i];
+      unicode::code_point_t v = c.code_point;
       unicode::_type_letter type_letter;
 
       if (is_letter(v, type_letter))
       {
-        current_case = update_type(current_case, type_letter);
+        current_case = update_case(current_case, type_letter);
         unicode::code_point_t lower = unicode::get_lower(v);
         if (lower)
           v = lower;
       }
 
-      new_token += unicode::cp_to_utf8(v);
+      output += unicode::cp_to_utf8(v);
     }
 
-    return std::make_pair(new_token, type_to_char(current_case));
+    return current_case;
   }
 
   std::string CaseModifier::apply_case(const std::string& token, char feat)
   {
-    Type case_type = char_to_type(feat);
+    return apply_case(token, char_to_type(feat));
+  }
 
+  std::string CaseModifier::apply_case(const std::string& token, Type case_type)
+  {
     if (case_type == Type::Lowercase || case_type == Type::None)
       return token;
 
-    std::vector<std::string> chars;
-    std::vector<unicode::code_point_t> code_points;
-
-    unicode::explode_utf8(token, chars, code_points);
-
     std::string new_token;
+    new_token.reserve(token.size());
+    apply_case(token, case_type, new_token);
+    return new_token;
+  }
+
+  void CaseModifier::apply_case(StringView token, Type case_type, std::string& output)
+  {
+    if (case_type == Type::Lowercase || case_type == Type::None)
+    {
+      output.append(token.data(), token.size());
+      return;
+    }
 
-    for (size_t i = 0; i < chars.size(); ++i)
+    for (const auto& c: unicode::Utf8Range(token.data(), token.size()))
     {
-      unicode::code_point_t v = code_points[i];
+      unicode::code_point_t v = c.code_point;
 
-      if (new_token.empty() || case_type == Type::Uppercase)
+      if (c.offset == 0 || case_type == Type::Uppercase)
       {
         unicode::code_point_t upper = unicode::get_upper(v);
         if (upper)
           v = upper;
       }
 
-      new_token += unicode::cp_to_utf8(v);
+      output += unicode::cp_to_utf8(v);
     }
-
-    return new_token;
   }
 
   char CaseModifier::type_to_char(Type type)
@@ -1,25 +1,71 @@
 #include "onmt/ITokenizer.h"
 
 #include "onmt/SpaceTokenizer.h"
+#include "onmt/Tokenizer.h"
 
 namespace onmt
 {
 
   const std::string ITokenizer::feature_marker("￨");
 
-  void ITokenizer::tokenize(const std::string& text, std::vector<std::string>& words)
+  void ITokenizer::tokenize(const std::string& text, std::vector<std::string>& words) const
   {
     std::vector<std::vector<std::string> > features;
     tokenize(text, words, features);
   }
 
-  std::string ITokenizer::detokenize(const std::vector<std::string>& words)
+  std::string ITokenizer::detokenize(const std::vector<std::string>& words) const
   {
     std::vector<std::vector<std::string> > features;
     return detokenize(words, features);
   }
 
-  std::string ITokenizer::tokenize(const std::string& text)
+  void ITokenizer::tokenize(const std::string& text, TokenBatch& batch) const
+  {
+    std::vector<std::string> words;
+    std::vector<std::vector<std::string> > features;
+
+    tokenize(text, words, features);
+
+    batch.clear();
+    for (const auto& word: words)
+      batch.tokens().push_back(word);
+    for (const auto& feature: features)
+    {
+      StringColumn& column = batch.add_feature();
+      for (const auto& value: feature)
+        column.push_back(value);
+    }
+  }
+
+  std::string ITokenizer::detokenize(const TokenBatch& batch) const
+  {
+    batch.check_features();
+
+    std::vector<std::string> words;
+    std::vector<std::vector<std::string> > features(batch.num_features());
+
+    for (size_t i = 0; i < batch.size(); ++i)
+    {
+      words.emplace_back();
+      batch.append_token(i, Tokenizer::joiner_marker, words.back());
+    }
+    for (size_t j = 0; j < batch.num_features(); ++j)
+    {
+      for (size_t i = 0; i < batch.size(); ++i)
+        features[j].push_back(batch.feature(j)[i].to_string());
+    }
+    if (!batch.case_feature().empty())
+    {
+      features.emplace_back();
+      for (const auto case_type: batch.case_feature())
+        features.back().emplace_back(1, CaseModifier::type_to_char(case_type));
+    }
+
+    return detokenize(words, features);
+  }
+
+  std::string ITokenizer::tokenize(const std::string& text) const
   {
     std::vector<std::string> words;
     std::vector<std::vector<std::string> > features;
@@ -40,7 +86,7 @@ namespace onmt
     return output;
   }
 
-  std::string ITokenizer::detokenize(const std::string& text)
+  std::string ITokenizer::detokenize(const std::string& text) const
   {
     std::vector<std::string> words;
     std::vector<std::vector<std::string> > features;
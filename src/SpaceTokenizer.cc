@@ -1,7 +1,9 @@
 #include "onmt/SpaceTokenizer.h"
 
+#include <algorithm>
 #include <sstream>
 
+#include "onmt/Tokenizer.h"
 #include "onmt/unicode/Unicode.h"
 
 namespace onmt
@@ -15,31 +17,62 @@ namespace onmt
 
   void SpaceTokenizer::tokenize(const std::string& text,
                                 std::vector<std::string>& words,
-                                std::vector<std::vector<std::string> >& features)
+                                std::vector<std::vector<std::string> >& features) const
   {
-    std::vector<std::string> chunks = unicode::split_utf8(text, " ");
+    std::vector<StringView> chunks = unicode::split_utf8(text, " ");
 
     for (const auto& chunk: chunks)
     {
       if (chunk.empty())
         continue;
 
-      std::vector<std::string> fields = unicode::split_utf8(chunk, ITokenizer::feature_marker);
+      std::vector<StringView> fields = unicode::split_utf8(chunk, ITokenizer::feature_marker);
 
-      words.push_back(fields[0]);
+      words.emplace_back(fields[0].data(), fields[0].size());
 
       for (size_t i = 1; i < fields.size(); ++i)
       {
         if (features.size() < i)
-          features.emplace_back(1, fields[i]);
+          features.emplace_back(1, fields[i].to_string());
         else
-          features[i - 1].push_back(fields[i]);
+          features[i - 1].emplace_back(fields[i].data(), fields[i].size());
+      }
+    }
+  }
+
+  void SpaceTokenizer::tokenize(const std::string& text, TokenBatch& batch) const
+  {
+    batch.clear();
+
+    const StringView marker(ITokenizer::feature_marker);
+
+    for (const auto& chunk: unicode::split_utf8(text, " "))
+    {
+      if (chunk.empty())
+        continue;
+
+      const char* field = chunk.begin();
+      for (size_t i = 0; ; ++i)
+      {
+        const char* end = std::search(field, chunk.end(), marker.begin(), marker.end());
+        const StringView value(field, end - field);
+
+        if (i == 0)
+          batch.tokens().push_back(value);
+        else if (batch.num_features() < i)
+          batch.add_feature().push_back(value);
+        else
+          batch.feature(i - 1).push_back(value);
+
+        if (end == chunk.end())
+          break;
+        field = end + marker.size();
       }
     }
   }
 
   std::string SpaceTokenizer::detokenize(const std::vector<std::string>& words,
-                                         const std::vector<std::vector<std::string> >& features)
+                                         const std::vector<std::vector<std::string> >& features) const
   {
     std::ostringstream oss;
 
@@ -59,4 +92,31 @@ namespace onmt
     return oss.str();
   }
 
+  std::string SpaceTokenizer::detokenize(const TokenBatch& batch) const
+  {
+    batch.check_features();
+
+    std::string line;
+
+    for (size_t i = 0; i < batch.size(); ++i)
+    {
+      if (i > 0)
+        line += " ";
+      batch.append_token(i, Tokenizer::joiner_marker, line);
+
+      for (size_t j = 0; j < batch.num_features(); ++j)
+      {
+        line += ITokenizer::feature_marker;
+        line.append(batch.feature(j)[i].data(), batch.feature(j)[i].size());
+      }
+      if (!batch.case_feature().empty())
+      {
+        line += ITokenizer::feature_marker;
+        line += CaseModifier::type_to_char(batch.case_feature()[i]);
+      }
+    }
+
+    return line;
+  }
+
 }
@@ -0,0 +1,51 @@
+#include "onmt/StreamTokenizer.h"
+
+namespace onmt
+{
+
+  StreamTokenizer::StreamTokenizer(const Tokenizer& tokenizer)
+    : _tokenizer(tokenizer)
+  {
+    reset();
+  }
+
+  void StreamTokenizer::feed(StringView chunk, TokenBatch& batch)
+  {
+    _text.append(chunk.data(), chunk.size());
+
+    const size_t split = find_split();
+    if (split == 0)
+      return;
+
+    _tokenizer.tokenize_part(StringView(_text).substr(0, split), batch, _workspace, _registers);
+    _text.erase(0, split);
+    _search.offset -= split;
+  }
+
+  void StreamTokenizer::finish(TokenBatch& batch)
+  {
+    if (!_text.empty())
+      _tokenizer.tokenize_part(_text, batch, _workspace, _registers);
+    reset();
+  }
+
+  void StreamTokenizer::reset()
+  {
+    _registers = Tokenizer::KernelRegisters{0, 0};
+    _text.clear();
+    _search = Tokenizer::SplitSearch{0, false, false};
+  }
+
+  size_t StreamTokenizer::find_split()
+  {
+    size_t split = 0;
+    while (true)
+    {
+      const size_t position = _tokenizer.find_split(_text, _search);
+      if (position == std::string::npos)
+        return split;
+      split = position;
+    }
+  }
+
+}
@@ -0,0 +1,309 @@
+#include "onmt/TokenizedText.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "onmt/unicode/Unicode.h"
+
+namespace onmt
+{
+
+  // Blocks are cut at the first position where the text can be split after this size,
+  // so that an edit tokenizes again a few hundred bytes around it.
+  static const size_t min_block_size = 256;
+
+  struct TokenizedText::Node
+  {
+    Block block;
+    Tree left;
+    Tree right;
+    uint32_t priority;  // Greater than the priorities of the children.
+    size_t size;
+    size_t num_tokens;
+  };
+
+  TokenizedText::TokenizedText(const Tokenizer& tokenizer, StringView text)
+    : _tokenizer(tokenizer)
+    , _size(0)
+    , _num_tokens(0)
+  {
+    std::string window(text.data(), text.size());
+    Tree next;
+    std::vector<Tree> stale;
+    _blocks = tokenize_blocks(window, Tokenizer::KernelRegisters{0, 0}, next, stale);
+    if (_blocks)
+    {
+      _size = _blocks->size;
+      _num_tokens = _blocks->num_tokens;
+    }
+  }
+
+  TokenizedText::~TokenizedText() = default;
+
+  void TokenizedText::replace(size_t offset, size_t length, StringView replacement)
+  {
+    if (offset > _size || length > _size - offset)
+      throw std::invalid_argument("Edit range [" + std::to_string(offset) + ", "
+                                  + std::to_string(offset + length)
+                                  + ") is out of the text of size "
+                                  + std::to_string(_size));
+
+    // The window to tokenize again starts at the last block that begins before the
+    // edited characters, and ends with the block containing the character after them:
+    // the positions where the blocks are split depend on both adjacent characters.
+    Tree left;
+    Tree window_blocks;
+    Tree right;
+    split(std::move(_blocks), 0,
+          [offset](const Block& block, size_t begin) {
+            const unsigned int first_char = unicode::utf8_sequence_length(block.text.data(),
+                                                                           block.text.size());
+            return begin + std::max(first_char, 1u) <= offset;
+          },
+          left, right);
+    if (left)
+      right = merge(pop_back(left), std::move(right));
+    const size_t window_begin = left ? left->size : 0;
+
+    const size_t edit_end = offset + length;
+    split(std::move(right), window_begin,
+          [edit_end](const Block& block, size_t begin) {
+            return begin + block.text.size() <= edit_end;
+          },
+          window_blocks, right);
+    if (right)
+      window_blocks = merge(std::move(window_blocks), pop_front(right));
+
+    std::string window;
+    Tokenizer::KernelRegisters registers{0, 0};
+    std::vector<Tree> stale;
+    if (window_blocks)
+    {
+      window.reserve(window_blocks->size - length + replacement.size());
+      flatten(std::move(window_blocks), stale);
+      registers = stale.front()->block.registers;
+      for (const auto& node : stale)
+        window += node->block.text;
+    }
+    window.replace(offset - window_begin, length, replacement.data(), replacement.size());
+
+    Tree blocks = tokenize_blocks(window, registers, right, stale);
+    _blocks = merge(merge(std::move(left), std::move(blocks)), std::move(right));
+    _size = _blocks ? _blocks->size : 0;
+    _num_tokens = _blocks ? _blocks->num_tokens : 0;
+  }
+
+  TokenizedText::Tree TokenizedText::tokenize_blocks(std::string& text,
+                                                     Tokenizer::KernelRegisters registers,
+                                                     Tree& next,
+                                                     std::vector<Tree>& stale)
+  {
+    Tree blocks;
+    Tokenizer::SplitSearch search{0, false, false};
+    size_t begin = 0;
+
+    while (true)
+    {
+      const size_t split = _tokenizer.find_split(text, search);
+      if (split != std::string::npos)
+      {
+        if (split - begin >= min_block_size)
+        {
+          Tree node = new_node(stale);
+          set_block(*node, StringView(text).substr(begin, split - begin), registers);
+          blocks = merge(std::move(blocks), std::move(node));
+          begin = split;
+        }
+        continue;
+      }
+
+      const StringView rest = StringView(text).substr(begin);
+      if (!next)
+      {
+        if (!rest.empty())
+        {
+          Tree node = new_node(stale);
+          set_block(*node, rest, registers);
+          blocks = merge(std::move(blocks), std::move(node));
+        }
+        break;
+      }
+
+      // The next block is kept if the text can still be split before it and its tokens
+      // start in the same state.
+      if (search.after_separator && search.offset == text.size())
+      {
+        Tree node = new_node(stale);
+        set_block(*node, rest, registers);
+        const Node* first = next.get();
+        while (first->left)
+          first = first->left.get();
+        if (registers.type_letter == first->block.registers.type_letter
+            && registers.prev_script == first->block.registers.prev_script)
+        {
+          blocks = merge(std::move(blocks), std::move(node));
+          break;
+        }
+        // The text is tokenized again with the next block.
+        registers = node->block.registers;
+        stale.emplace_back(std::move(node));
+      }
+
+      Tree node = pop_front(next);
+      text += node->block.text;
+      stale.emplace_back(std::move(node));
+    }
+
+    return blocks;
+  }
+
+  TokenizedText::Tree TokenizedText::new_node(std::vector<Tree>& stale)
+  {
+    Tree node;
+    if (stale.empty())
+      node.reset(new Node());
+    else
+    {
+      node = std::move(stale.back());
+      stale.pop_back();
+    }
+    node->priority = static_cast<uint32_t>(_random());
+    return node;
+  }
+
+  void TokenizedText::set_block(Node& node,
+                                StringView text,
+                                Tokenizer::KernelRegisters& registers)
+  {
+    Block& block = node.block;
+    block.registers = registers;
+    block.text.assign(text.data(), text.size());
+    block.tokens.clear();
+    _tokenizer.tokenize_part(text, block.tokens, _workspace, registers);
+    update(node);
+  }
+
+  void TokenizedText::update(Node& node)
+  {
+    node.size = node.block.text.size();
+    node.num_tokens = node.block.tokens.size();
+    for (const Node* child : {node.left.get(), node.right.get()})
+    {
+      if (child)
+      {
+        node.size += child->size;
+        node.num_tokens += child->num_tokens;
+      }
+    }
+  }
+
+  TokenizedText::Tree TokenizedText::merge(Tree left, Tree right)
+  {
+    if (!left)
+      return right;
+    if (!right)
+      return left;
+    if (left->priority > right->priority)
+    {
+      left->right = merge(std::move(left->right), std::move(right));
+      update(*left);
+      return left;
+    }
+    right->left = merge(std::move(left), std::move(right->left));
+    update(*right);
+    return right;
+  }
+
+  template <typename Predicate>
+  void TokenizedText::split(Tree tree, size_t begin, Predicate before, Tree& left, Tree& right)
+  {
+    if (!tree)
+    {
+      left.reset();
+      right.reset();
+      return;
+    }
+
+    const size_t node_begin = begin + (tree->left ? tree->left->size : 0);
+    if (before(tree->block, node_begin))
+    {
+      split(std::move(tree->right), node_begin + tree->block.text.size(), before,
+            tree->right, right);
+      update(*tree);
+      left = std::move(tree);
+    }
+    else
+    {
+      split(std::move(tree->left), begin, before, left, tree->left);
+      update(*tree);
+      right = std::move(tree);
+    }
+  }
+
+  TokenizedText::Tree TokenizedText::pop_front(Tree& tree)
+  {
+    if (tree->left)
+    {
+      Tree node = pop_front(tree->left);
+      update(*tree);
+      return node;
+    }
+    Tree node = std::move(tree);
+    tree = std::move(node->right);
+    update(*node);
+    return node;
+  }
+
+  TokenizedText::Tree TokenizedText::pop_back(Tree& tree)
+  {
+    if (tree->right)
+    {
+      Tree node = pop_back(tree->right);
+      update(*tree);
+      return node;
+    }
+    Tree node = std::move(tree);
+    tree = std::move(node->left);
+    update(*node);
+    return node;
+  }
+
+  void TokenizedText::flatten(Tree tree, std::vector<Tree>& nodes)
+  {
+    if (!tree)
+      return;
+    flatten(std::move(tree->left), nodes);
+    Tree right = std::move(tree->right);
+    nodes.emplace_back(std::move(tree));
+    flatten(std::move(right), nodes);
+  }
+
+  template <typename Function>
+  void TokenizedText::for_each_block(const Node* node, Function function)
+  {
+    if (!node)
+      return;
+    for_each_block(node->left.get(), function);
+    function(node->block);
+    for_each_block(node->right.get(), function);
+  }
+
+  std::string TokenizedText::text() const
+  {
+    std::string text;
+    text.reserve(_size);
+    for_each_block(_blocks.get(), [&text](const Block& block) {
+      text += block.text;
+    });
+    return text;
+  }
+
+  void TokenizedText::get_tokens(TokenBatch& batch) const
+  {
+    batch.clear();
+    for_each_block(_blocks.get(), [&batch](const Block& block) {
+      batch.append(block.tokens);
+    });
+  }
+
+}
@@ -1,6 +1,11 @@
 #include "onmt/Tokenizer.h"
 
+#include <algorithm>
+#include <cstring>
+#include <exception>
 #include <mutex>
+#include <stdexcept>
+#include <thread>
 
 #include "onmt/CaseModifier.h"
 #include "onmt/unicode/Unicode.h"
@@ -9,12 +14,6 @@ namespace onmt
 {
 
   const std::string Tokenizer::joiner_marker("￭");
-  const std::map<std::string, std::string> substitutes = {
-                                                      { "￭", "■" },
-                                                      { "￨", "│" },
-                                                      { "％", "%" },
-                                                      { "＃", "#" },
-                                                      { "：", ":" }};
   const std::string Tokenizer::ph_marker_open = "｟";
   const std::string Tokenizer::ph_marker_close = "｠";
   const std::string protected_character = "％";
@@ -25,10 +24,10 @@ namespace onmt
     { "space", onmt::Tokenizer::Mode::Space }
   };
 
-  static std::unordered_map<std::string, BPE*> bpe_cache;
+  static std::unordered_map<std::string, std::shared_ptr<const BPE> > bpe_cache;
   static std::mutex bpe_cache_mutex;
 
-  static BPE* load_bpe(const std::string& bpe_model_path)
+  static std::shared_ptr<const BPE> load_bpe(const std::string& bpe_model_path)
   {
     std::lock_guard<std::mutex> lock(bpe_cache_mutex);
 
@@ -36,7 +35,7 @@ namespace onmt
     if (it != bpe_cache.end())
       return it->second;
 
-    BPE* bpe = new BPE(bpe_model_path);
+    std::shared_ptr<const BPE> bpe = std::make_shared<BPE>(bpe_model_path);
     bpe_cache[bpe_model_path] = bpe;
     return bpe;
   }
@@ -52,392 +51,1776 @@ namespace onmt
     , _with_separators(flags & Flags::WithSeparators)
     , _segment_case(flags & Flags::SegmentCase)
     , _segment_numbers(flags & Flags::SegmentNumbers)
-    , _cache_bpe_model(flags & Flags::CacheBPEModel)
-    , _bpe(nullptr)
+    , _skip_invalid_utf8(flags & Flags::SkipInvalidUtf8)
+    , _throw_on_invalid_utf8(flags & Flags::ThrowOnInvalidUtf8)
+    , _normalize_nfc(flags & Flags::NormalizeNFC)
+    , _normalize_nfkc(flags & Flags::NormalizeNFKC)
+    , _segment_alphabet_change(flags & Flags::SegmentAlphabetChange)
     , _joiner(joiner)
   {
-    set_bpe_model(bpe_model_path, _cache_bpe_model);
-  }
-
-  Tokenizer::~Tokenizer()
-  {
-    if (!_cache_bpe_model)
-      delete _bpe;
+    set_bpe_model(bpe_model_path, flags & Flags::CacheBPEModel);
   }
 
   std::string Tokenizer::detokenize(const std::vector<std::string>& words,
-                                    const std::vector<std::vector<std::string> >& features)
+                                    const std::vector<std::vector<std::string> >& features) const
   {
     std::string line;
+    bool prev_right_join = false;
 
     for (size_t i = 0; i < words.size(); ++i)
     {
-      if (i > 0 && !has_right_join(words[i - 1]) && !has_left_join(words[i]))
-        line += " ";
+      StringView word = words[i];
 
-      std::string word = words[i];
+      if (i > 0 && !prev_right_join && !has_left_join(word))
+        line += " ";
 
-      if (has_right_join(word))
-        word.erase(word.length() - _joiner.length(), _joiner.length());
+      prev_right_join = has_right_join(word);
+      if (prev_right_join)
+        word = word.substr(0, word.size() - _joiner.size());
       if (has_left_join(word))
-        word.erase(0, _joiner.length());
+        word = word.substr(_joiner.size());
 
+      CaseModifier::Type case_type = CaseModifier::Type::None;
       if (_case_feature)
       {
         if (features.empty())
           throw std::runtime_error("Missing case feature");
-        word = CaseModifier::apply_case(word, features[0][i][0]);
+        case_type = CaseModifier::char_to_type(features[0][i][0]);
       }
 
-      line += word;
+      CaseModifier::apply_case(word, case_type, line);
     }
 
     return line;
   }
 
-  void Tokenizer::tokenize(const std::string& text,
-                           std::vector<std::string>& words,
-                           std::vector<std::vector<std::string> >& features)
+  std::string Tokenizer::detokenize(const TokenBatch& batch) const
+  {
+    std::string text;
+    detokenize(batch, text);
+    return text;
+  }
+
+  void Tokenizer::detokenize(const TokenBatch& batch, std::string& text) const
   {
-    if (_mode == Mode::Space) {
-      std::vector<std::string> chunks = unicode::split_utf8(text, " ");
-      for (const auto& chunk: chunks)
+    batch.check_features();
+    text.clear();
+    bool prev_right_join = false;
+
+    for (size_t i = 0; i < batch.size(); ++i)
+    {
+      const StringView word = batch.token(i);
+      // With JoinerNew, a joiner is a token that joins both sides.
+      const bool joiner_token = word == StringView(_joiner);
+
+      if (i > 0 && !prev_right_join && !batch.joiner_left(i) && !joiner_token)
+        text += " ";
+
+      prev_right_join = batch.joiner_right(i) || joiner_token;
+      if (joiner_token)
+        continue;
+
+      CaseModifier::Type case_type = CaseModifier::Type::None;
+      if (_case_feature)
       {
-        if (chunk.empty())
-          continue;
+        if (!batch.case_feature().empty())
+          case_type = batch.case_feature()[i];
+        else if (batch.num_features() > 0)
+          case_type = CaseModifier::char_to_type(batch.feature(0)[i][0]);
+        else
+          throw std::runtime_error("Missing case feature");
+      }
+
+      CaseModifier::apply_case(word, case_type, text);
+    }
+  }
+
+  void Tokenizer::append_token(const TokenBatch& batch, size_t i, std::string& text) const
+  {
+    // As in the string API, the joiners are lowercased with the case feature.
+    const auto append_joiner = [this, &text]() {
+      if (_case_feature)
+        CaseModifier::extract_case(_joiner, text);
+      else
+        text += _joiner;
+    };
+
+    const StringView token = batch.token(i);
+    if (batch.joiner_left(i))
+      append_joiner();
+    text.append(token.data(), token.size());
+    if (batch.joiner_right(i))
+      append_joiner();
+  }
+
+  // Conservative and aggressive tokenization are implemented as a state machine: each
+  // character is mapped to a class and the transition table gives the action to run
+  // and the next state. The letter type, the case of the previous letters and the
+  // script of the previous letter are kept in registers.
+  namespace
+  {
+
+    enum class CharClass : unsigned char
+    {
+      Separator,
+      Skip,  // Control characters and BOM, ignored outside placeholders.
+      PlaceholderOpen,
+      PlaceholderClose,
+      Letter,
+      Number,
+      Mark,
+      Hyphen,
+      Underscore,
+      DotComma,
+      Other,
+      Substituted,  // Reserved character replaced by get_substitute, otherwise as Other.
+      Count
+    };
+
+    enum class State : unsigned char
+    {
+      Space,  // Start of text or after a separator.
+      Other,  // After a character that is neither a letter nor a number.
+      Letter,
+      Number,
+      // After a placeholder, with the number flag of the state preceding the placeholder.
+      PlaceholderClosed,
+      PlaceholderClosedNumber,
+      InPlaceholder,
+      InPlaceholderNumber,
+      Count
+    };
+
+    enum class Action : unsigned char
+    {
+      Skip,
+      PlaceholderAppend,
+      PlaceholderAppendEscaped,
+      PlaceholderClose,
+      PlaceholderOpen,
+      PlaceholderOpenJoin,
+      PlaceholderOpenSplit,
+      PlaceholderOpenSplitJoinNext,
+      Separator,
+      SeparatorSplit,
+      // Actions below update the letter type register.
+      LetterAppend,
+      LetterJoin,
+      LetterSplit,
+      LetterInWord,
+      LetterLookahead,  // Dot or comma that is a letter if followed by a letter or a number.
+      NumberAppend,
+      NumberJoin,
+      NumberSplit,
+      NumberSplitJoinNext,
+      OtherAppend,
+      OtherJoin,
+      OtherSplit
+    };
+
+    struct Transition
+    {
+      Action action;
+      State next;
+    };
+
+    const size_t num_states = static_cast<size_t>(State::Count);
+    const size_t num_classes = static_cast<size_t>(CharClass::Count);
+
+    struct TransitionTable
+    {
+      Transition transitions[num_states][num_classes];
+
+      const Transition& get(State state, CharClass char_class) const
+      {
+        return transitions[static_cast<size_t>(state)][static_cast<size_t>(char_class)];
+      }
+    };
+
+    Transition get_transition(Tokenizer::Mode mode,
+                              bool segment_numbers,
+                              State state,
+                              CharClass char_class)
+    {
+      if (char_class == CharClass::Substituted)
+        char_class = CharClass::Other;
+
+      if (state == State::InPlaceholder || state == State::InPlaceholderNumber)
+      {
+        if (char_class == CharClass::PlaceholderClose)
+          return {Action::PlaceholderClose,
+                  state == State::InPlaceholder
+                  ? State::PlaceholderClosed
+                  : State::PlaceholderClosedNumber};
+        if (char_class == CharClass::Separator)
+          return {Action::PlaceholderAppendEscaped, state};
+        return {Action::PlaceholderAppend, state};
+      }
+
+      const bool letter = (state == State::Letter
+                           || state == State::PlaceholderClosed
+                           || state == State::PlaceholderClosedNumber);
+      const bool number = (state == State::Number || state == State::PlaceholderClosedNumber);
+      const bool space = (state == State::Space || state == State::Other);
+
+      switch (char_class)
+      {
+      case CharClass::PlaceholderOpen:
+      {
+        State next = number ? State::InPlaceholderNumber : State::InPlaceholder;
+        if (state == State::Space)
+          return {Action::PlaceholderOpen, next};
+        if (state == State::Other)
+          return {Action::PlaceholderOpenJoin, next};
+        if (state == State::PlaceholderClosed)
+          return {Action::PlaceholderOpenSplit, next};
+        return {Action::PlaceholderOpenSplitJoinNext, next};
+      }
+      case CharClass::Separator:
+        return {space ? Action::Separator : Action::SeparatorSplit, State::Space};
+      case CharClass::Skip:
+        return {Action::Skip, state};
+      default:
+        break;
+      }
+
+      bool cur_letter = char_class == CharClass::Letter;
+      bool cur_number = char_class == CharClass::Number;
+      if (char_class == CharClass::Mark)
+      {
+        cur_letter = letter;
+        cur_number = number;
+      }
+
+      if (mode == Tokenizer::Mode::Conservative)
+      {
+        if (cur_number
+            || (char_class == CharClass::Hyphen && letter)
+            || char_class == CharClass::Underscore)
+          cur_letter = true;
+        else if (char_class == CharClass::DotComma && letter && !cur_letter)
+          return {Action::LetterLookahead, State::Letter};
+      }
+
+      if (cur_letter)
+      {
+        Action action;
+        if (state == State::Space)
+          action = Action::LetterAppend;
+        else if (state == State::Other)
+          action = Action::LetterJoin;
+        else if (state == State::Number)
+          action = Action::LetterSplit;
+        else if (char_class == CharClass::Mark)
+          action = Action::LetterAppend;
+        else if (state == State::Letter)
+          action = Action::LetterInWord;
+        else
+          action = Action::LetterSplit;
+        return {action, State::Letter};
+      }
+
+      if (cur_number)
+      {
+        Action action;
+        if (state == State::Space)
+          action = Action::NumberAppend;
+        else if (state == State::Other)
+          action = Action::NumberJoin;
+        else if (state == State::Number)
+          action = segment_numbers ? Action::NumberSplit : Action::NumberAppend;
+        else if (state == State::Letter)
+          action = Action::NumberSplitJoinNext;
+        else
+          action = Action::NumberSplit;
+        return {action, State::Number};
+      }
+
+      if (state == State::Space)
+        return {Action::OtherAppend, State::Other};
+      if (state == State::Other)
+        return {Action::OtherJoin, State::Other};
+      return {Action::OtherSplit, State::Other};
+    }
+
+    TransitionTable build_transition_table(Tokenizer::Mode mode, bool segment_numbers)
+    {
+      TransitionTable table;
+      for (size_t s = 0; s < num_states; ++s)
+      {
+        for (size_t c = 0; c < num_classes; ++c)
+          table.transitions[s][c] = get_transition(mode,
+                                                   segment_numbers,
+                                                   static_cast<State>(s),
+                                                   static_cast<CharClass>(c));
+      }
+      return table;
+    }
+
+    const TransitionTable& get_transition_table(Tokenizer::Mode mode, bool segment_numbers)
+    {
+      static const TransitionTable tables[] = {
+        build_transition_table(Tokenizer::Mode::Conservative, false),
+        build_transition_table(Tokenizer::Mode::Conservative, true),
+        build_transition_table(Tokenizer::Mode::Aggressive, false),
+        build_transition_table(Tokenizer::Mode::Aggressive, true)
+      };
+      return tables[(mode == Tokenizer::Mode::Aggressive ? 2 : 0) + (segment_numbers ? 1 : 0)];
+    }
+
+    CharClass get_char_class(unicode::code_point_t v, unsigned char props)
+    {
+      if (props & unicode::_prop_separator)
+        return CharClass::Separator;
+      if (v <= 32)
+        return CharClass::Skip;
+      switch (v)
+      {
+      case '-':
+        return CharClass::Hyphen;
+      case '_':
+        return CharClass::Underscore;
+      case '.':
+      case ',':
+        return CharClass::DotComma;
+      case 0xFEFF:
+        return CharClass::Skip;
+      case 0xFF5F:
+        return CharClass::PlaceholderOpen;
+      case 0xFF60:
+        return CharClass::PlaceholderClose;
+      case 0xFF03:
+      case 0xFF05:
+      case 0xFF1A:
+      case 0xFFE8:
+      case 0xFFED:
+        return CharClass::Substituted;
+      default:
+        break;
+      }
+      if (props & unicode::_prop_mark)
+        return CharClass::Mark;
+      if (props & unicode::_prop_letter)
+        return CharClass::Letter;
+      if (props & unicode::_prop_number)
+        return CharClass::Number;
+      return CharClass::Other;
+    }
+
+    unicode::_type_letter get_letter_type(unsigned char props)
+    {
+      if (props & unicode::_prop_letter_lower)
+        return unicode::_letter_lower;
+      if (props & unicode::_prop_letter_upper)
+        return unicode::_letter_upper;
+      return unicode::_letter_other;
+    }
+
+    // Characters of a placeholder are appended to the token as is, except separators
+    // that are escaped and the closing marker. This table gives the bytes that may start
+    // such a character, so that other characters are skipped without decoding them.
+    class PlaceholderStopBytes
+    {
+    public:
+      PlaceholderStopBytes()
+        : _stop()
+        , _skip_ascii(true)
+      {
+        for (unicode::code_point_t c = 0; c < 0x10000; ++c)
+        {
+          if (is_stop(c))
+            _stop[get_first_byte(c)] = true;
+        }
+        // Characters outside the BMP and invalid sequences starting with a continuation
+        // byte are always decoded.
+        for (size_t b = 0x80; b < 0xC0; ++b)
+          _stop[b] = true;
+        for (size_t b = 0xF0; b < 0x100; ++b)
+          _stop[b] = true;
+        for (size_t b = 0x21; b < 0x80; ++b)
+          _skip_ascii = _skip_ascii && !_stop[b];
+      }
+
+      static bool is_stop(unicode::code_point_t c)
+      {
+        const CharClass char_class = get_char_class(c, unicode::get_properties(c));
+        return char_class == CharClass::Separator || char_class == CharClass::PlaceholderClose;
+      }
+
+      bool get(unsigned char b) const
+      {
+        return _stop[b];
+      }
+
+      // Runs of ASCII characters above the space can be skipped in bulk with
+      // unicode::skip_ascii_non_space.
+      bool skip_ascii() const
+      {
+        return _skip_ascii;
+      }
 
-        std::vector<std::string> fields = unicode::split_utf8(chunk, ITokenizer::feature_marker);
+    private:
+      bool _stop[256];
+      bool _skip_ascii;
 
-        words.push_back(fields[0]);
+      static unsigned char get_first_byte(unicode::code_point_t c)
+      {
+        if (c < 0x80)
+          return c;
+        if (c < 0x800)
+          return 0xC0 | (c >> 6);
+        return 0xE0 | (c >> 12);
+      }
+    };
+
+    // Returns the offset of the first separator or closing marker at or after offset,
+    // or the size of text. Characters are decoded as by unicode::Utf8Iterator.
+    size_t find_placeholder_stop(StringView text, size_t offset)
+    {
+      static const PlaceholderStopBytes stop_bytes;
+      const unsigned char* s = reinterpret_cast<const unsigned char*>(text.data());
+      const size_t size = text.size();
+      size_t i = offset;
+
+      while (i < size)
+      {
+        if (stop_bytes.skip_ascii())
+        {
+          i = unicode::skip_ascii_non_space(text.data(), size, i);
+          if (i == size)
+            break;
+        }
 
-        for (size_t i = 1; i < fields.size(); ++i)
+        const unsigned char b = s[i];
+        if (b < 0x80)
         {
-          if (features.size() < i)
-            features.emplace_back(1, fields[i]);
-          else
-            features[i - 1].push_back(fields[i]);
+          if (stop_bytes.get(b))
+            return i;
+          ++i;
+          continue;
         }
+
+        unsigned int length = 0;
+        const unicode::code_point_t c = unicode::utf8_to_cp(s + i, size - i, length);
+        if (length == 0)
+          length = 1;
+        if (stop_bytes.get(b) && PlaceholderStopBytes::is_stop(c))
+          return i;
+        i += length;
       }
+
+      return size;
+    }
+
+    // Records in letters the type of the letter c of a text, and replaces it by its
+    // lowercase form in lowercase. Both start as copies of the text; lowercase is cleared
+    // if the lowercase form does not have the same length.
+    void lowercase_letter(const unicode::Utf8Char& c,
+                          unsigned char props,
+                          std::string& lowercase,
+                          std::string& letters)
+    {
+      if (lowercase.empty())
+        return;
+
+      const unicode::_type_letter type = get_letter_type(props);
+      letters[c.offset] = type;
+      if (type == unicode::_letter_lower)
+        return;
+
+      const unicode::code_point_t lower = unicode::get_lower(c.code_point);
+      if (!lower || lower == c.code_point)
+        return;
+      const std::string chr = unicode::cp_to_utf8(lower);
+      if (chr.size() != c.length)
+        lowercase.clear();
+      else
+        lowercase.replace(c.offset, c.length, chr);
     }
-    else {
-      std::vector<std::string> chars;
-      std::vector<unicode::code_point_t> code_points;
 
-      unicode::explode_utf8(text, chars, code_points);
+    void lowercase_string(StringView str, std::string& lowercase, std::string& letters)
+    {
+      lowercase.assign(str.data(), str.size());
+      letters.assign(str.size(), 0);
+      for (const auto& c: unicode::Utf8Range(str.data(), str.size()))
+      {
+        const unsigned char props = unicode::get_properties(c.code_point);
+        if (props & unicode::_prop_letter)
+          lowercase_letter(c, props, lowercase, letters);
+      }
+    }
 
-      std::string token;
+    // CaseModifier::update_case as a table, indexed by case and letter type.
+    class CaseTable
+    {
+    public:
+      CaseTable()
+      {
+        for (size_t i = 0; i < num_cases; ++i)
+          for (size_t j = 0; j < num_letters; ++j)
+            _next[i][j] = CaseModifier::update_case(static_cast<CaseModifier::Type>(i),
+                                                    static_cast<unicode::_type_letter>(j));
+      }
 
-      bool letter = false;
-      bool uppercase = false;
-      bool uppercase_sequence = false;
-      bool number = false;
-      bool other = false;
-      bool space = true;
+      CaseModifier::Type get(CaseModifier::Type current, char letter) const
+      {
+        return _next[static_cast<size_t>(current)][static_cast<size_t>(letter)];
+      }
+
+    private:
+      static const size_t num_cases = static_cast<size_t>(CaseModifier::Type::None) + 1;
+      static const size_t num_letters = unicode::_letter_upper + 1;
+      CaseModifier::Type _next[num_cases][num_letters];
+    };
+
+    const CaseTable case_table;
+
+    // Returns the case of a string from its letter types, starting from case_type.
+    CaseModifier::Type get_case(StringView letters,
+                                CaseModifier::Type case_type = CaseModifier::Type::None)
+    {
+      for (char letter: letters)
+        case_type = case_table.get(case_type, letter);
+      return case_type;
+    }
+
+    // Token being built as a range of the input text.
+    class TokenBuilder
+    {
+    public:
+      TokenBuilder()
+        : _token{0, 0, false, false, false}
+      {
+      }
+
+      bool empty() const
+      {
+        return _token.begin == _token.end;
+      }
+
+      void append(size_t offset, size_t length)
+      {
+        if (empty())
+          _token.begin = offset;
+        else if (offset != _token.end)
+          _token.substituted = true;
+        _token.end = offset + length;
+      }
+
+      void append_substituted(size_t offset, size_t length)
+      {
+        append(offset, length);
+        _token.substituted = true;
+      }
+
+      void join_left()
+      {
+        _token.joiner_left = true;
+      }
+
+      void join_right()
+      {
+        _token.joiner_right = true;
+      }
+
+      // Pushes the token and starts a new one at offset.
+      void push(std::vector<TokenSpan>& spans, size_t offset)
+      {
+        if (empty())
+          _token.begin = _token.end = offset;
+        spans.push_back(_token);
+        _token = {offset, offset, false, false, false};
+      }
+
+    private:
+      TokenSpan _token;
+    };
+
+    // Returns the replacement of a character of class Substituted.
+    const char* get_substitute(unicode::code_point_t c)
+    {
+      switch (c)
+      {
+      case 0xFF03:  // ＃
+        return "#";
+      case 0xFF05:  // ％
+        return "%";
+      case 0xFF1A:  // ：
+        return ":";
+      case 0xFFE8:  // ￨
+        return "│";
+      case 0xFFED:  // ￭
+      default:
+        return "■";
+      }
+    }
+
+    // Appends c in lowercase hexadecimal with at least 4 digits.
+    void append_hex(unicode::code_point_t c, std::string& out)
+    {
+      static const char digits[] = "0123456789abcdef";
+      char buffer[8];
+      size_t length = 0;
+      do
+      {
+        buffer[length++] = digits[c & 0xF];
+        c >>= 4;
+      } while (c || length < 4);
+      while (length > 0)
+        out += buffer[--length];
+    }
+
+    void append_token_text(StringView text, const TokenSpan& span, std::string& out)
+    {
+      const StringView token = text.substr(span.begin, span.end - span.begin);
+      if (!span.substituted)
+      {
+        out.append(token.data(), token.size());
+        return;
+      }
+
+      // Replay the transformations applied by the tokenizer on each character.
       bool placeholder = false;
-      std::string prev_alphabet;
-
-      unicode::_type_letter type_letter;
-
-      for (size_t i = 0; i < chars.size(); ++i)
-      {
-        std::string c = chars[i];
-        unicode::code_point_t v = code_points[i];
-        unicode::code_point_t next_v = i + 1 < code_points.size() ? code_points[i + 1] : 0;
-        bool isSeparator = unicode::is_separator(v);
-
-        if (placeholder) {
-            if (c == Tokenizer::ph_marker_close) {
-              token = token + c;
-              letter = true;
-              prev_alphabet = "placeholder";
-              placeholder = false;
-              space = false;
-            } else {
-              if (isSeparator) {
-                char buffer[10];
-                sprintf(buffer, "%04x", v);
-                c = protected_character + buffer;
-              }
-              token += c;
-            }
-          }
-          else if (c == Tokenizer::ph_marker_open) {
-            std::string initc;
-            if (!space) {
-              if (_joiner_annotate && !_joiner_new) {
-                if ((letter && prev_alphabet != "placeholder") || number)
-                  initc = _joiner;
-                else
-                  token += _joiner;
-              }
-              words.push_back(token);
-              token = initc;
-              if (_joiner_annotate && _joiner_new)
-                words.push_back(_joiner);
-            } else if (other) {
-              if (_joiner_annotate && token.length() == 0) {
-                if (_joiner_new) words.push_back(_joiner);
-                else words[words.size()-1] += _joiner;
-              }
-            }
-            token += c;
-            placeholder = true;
-        }
-        else if (isSeparator)
+      for (const auto& c: unicode::Utf8Range(token.data(), token.size()))
+      {
+        const CharClass char_class = get_char_class(c.code_point,
+                                                    unicode::get_properties(c.code_point));
+
+        if (placeholder)
         {
-          if (!space)
+          if (char_class == CharClass::PlaceholderClose)
+            placeholder = false;
+          else if (char_class == CharClass::Separator)
           {
-            words.push_back(token);
-            token.clear();
+            out += protected_character;
+            append_hex(c.code_point, out);
+            continue;
           }
+        }
+        else if (char_class == CharClass::PlaceholderOpen)
+          placeholder = true;
+        else if (char_class == CharClass::Skip)
+          continue;
+        else if (char_class == CharClass::Substituted)
+        {
+          out += get_substitute(c.code_point);
+          continue;
+        }
 
-          if (v == 0x200D) // Zero-Width joiner.
-          {
-            if (_joiner_annotate)
-            {
-              if (_joiner_new && !words.empty())
-                words.push_back(_joiner);
-              else
-              {
-                if (other || (number && unicode::is_letter(next_v, type_letter)))
-                  words.back() += _joiner;
-                else
-                  token = _joiner;
-              }
-            }
-          }
-          else if (_with_separators)
-          {
-            token += c;
-            if (!unicode::is_separator(next_v))
-            {
-              words.push_back(token);
-              token.clear();
-            }
-          }
+        out.append(token.data() + c.offset, c.length);
+      }
+    }
 
-          letter = false;
-          uppercase = false;
-          uppercase_sequence = false;
-          number = false;
-          other = false;
-          space = true;
+    bool contains(StringView str, StringView sub)
+    {
+      return std::search(str.begin(), str.end(), sub.begin(), sub.end()) != str.end();
+    }
+
+    // Calls add_field(field, index) on each field of the tokens separated by spaces, up
+    // to max_tokens tokens: index 0 is the token and the next ones are its features.
+    // Returns true if tokens were left out.
+    template <typename AddField>
+    bool split_space_tokens(StringView text, size_t max_tokens, AddField add_field)
+    {
+      const StringView marker(ITokenizer::feature_marker);
+      const char* end = text.end();
+      const char* chunk = text.begin();
+      size_t num_tokens = 0;
+
+      while (true)
+      {
+        const char* chunk_end = static_cast<const char*>(std::memchr(chunk, ' ', end - chunk));
+        if (!chunk_end)
+          chunk_end = end;
+        if (chunk_end != chunk && num_tokens++ == max_tokens)
+          return true;
+
+        const char* field = chunk;
+        for (size_t i = 0; chunk_end != chunk; ++i)
+        {
+          const char* field_end = std::search(field, chunk_end, marker.begin(), marker.end());
+          add_field(StringView(field, field_end - field), i);
+          if (field_end == chunk_end)
+            break;
+          field = field_end + marker.size();
         }
+
+        if (chunk_end == end)
+          break;
+        chunk = chunk_end + 1;
+      }
+
+      return false;
+    }
+
+    // Sinks receive the tokens with their joiners, and the case of each token when the
+    // case feature is enabled and with_case is set. size() is the number of tokens held.
+
+    // Adds tokens and features to the vectors of the string API.
+    class WordsSink
+    {
+    public:
+      static const bool with_case = true;
+
+      WordsSink(std::vector<std::string>& words,
+                std::vector<std::vector<std::string> >& features,
+                std::vector<std::string>& case_feature)
+        : _words(words)
+        , _features(features)
+        , _case_feature(case_feature)
+      {
+      }
+
+      size_t size() const
+      {
+        return _words.size();
+      }
+
+      // left and right are the joiners placed around token, or empty.
+      void add_token(StringView left, StringView token, StringView right)
+      {
+        _words.emplace_back();
+        std::string& word = _words.back();
+        word.reserve(left.size() + token.size() + right.size());
+        word.append(left.data(), left.size());
+        word.append(token.data(), token.size());
+        word.append(right.data(), right.size());
+      }
+
+      void add_token(StringView left,
+                     StringView token,
+                     StringView right,
+                     CaseModifier::Type case_type)
+      {
+        add_token(left, token, right);
+        _case_feature.emplace_back(1, CaseModifier::type_to_char(case_type));
+      }
+
+      void add_feature(StringView value, size_t index)
+      {
+        if (_features.size() < index)
+          _features.emplace_back(1, value.to_string());
         else
+          _features[index - 1].emplace_back(value.data(), value.size());
+      }
+
+    private:
+      std::vector<std::string>& _words;
+      std::vector<std::vector<std::string> >& _features;
+      std::vector<std::string>& _case_feature;
+    };
+
+    // Adds tokens and features to a batch.
+    class BatchSink
+    {
+    public:
+      static const bool with_case = true;
+
+      BatchSink(TokenBatch& batch)
+        : _batch(batch)
+      {
+      }
+
+      size_t size() const
+      {
+        return _batch.size();
+      }
+
+      // The joiners are recorded as flags and not written.
+      void add_token(StringView left, StringView token, StringView right)
+      {
+        _batch.tokens().push_back(token);
+        if (!left.empty() || !right.empty())
+          _batch.set_joiners(!left.empty(), !right.empty());
+      }
+
+      void add_token(StringView left,
+                     StringView token,
+                     StringView right,
+                     CaseModifier::Type case_type)
+      {
+        add_token(left, token, right);
+        _batch.case_feature().push_back(case_type);
+      }
+
+      void add_feature(StringView value, size_t index)
+      {
+        if (_batch.num_features() < index)
+          _batch.add_feature().push_back(value);
+        else
+          _batch.feature(index - 1).push_back(value);
+      }
+
+    private:
+      TokenBatch& _batch;
+    };
+
+    // Counts the tokens without building them.
+    class CountSink
+    {
+    public:
+      static const bool with_case = false;
+
+      CountSink()
+        : _count(0)
+      {
+      }
+
+      size_t size() const
+      {
+        return _count;
+      }
+
+      void add_token(StringView, StringView, StringView)
+      {
+        ++_count;
+      }
+
+      void add_token(StringView, StringView, StringView, CaseModifier::Type)
+      {
+        ++_count;
+      }
+
+      void add_feature(StringView, size_t)
+      {
+      }
+
+    private:
+      size_t _count;
+    };
+
+    // Adds the vocabulary IDs of the tokens, and optionally their case.
+    class IdSink
+    {
+    public:
+      static const bool with_case = true;
+
+      IdSink(const Vocabulary& vocabulary,
+             std::vector<int32_t>& ids,
+             std::vector<CaseModifier::Type>* case_feature)
+        : _vocabulary(vocabulary)
+        , _ids(ids)
+        , _case_feature(case_feature)
+      {
+      }
+
+      size_t size() const
+      {
+        return _ids.size();
+      }
+
+      void add_token(StringView left, StringView token, StringView right)
+      {
+        _ids.push_back(_vocabulary.lookup(left, token, right));
+      }
+
+      void add_token(StringView left,
+                     StringView token,
+                     StringView right,
+                     CaseModifier::Type case_type)
+      {
+        add_token(left, token, right);
+        if (_case_feature)
+          _case_feature->push_back(case_type);
+      }
+
+      void add_feature(StringView, size_t)
+      {
+      }
+
+    private:
+      const Vocabulary& _vocabulary;
+      std::vector<int32_t>& _ids;
+      std::vector<CaseModifier::Type>* _case_feature;
+    };
+
+  }
+
+  void Tokenizer::tokenize(const std::string& text,
+                           std::vector<std::string>& words,
+                           std::vector<std::vector<std::string> >& features) const
+  {
+    Workspace workspace;
+    const StringView input = prepare_text(text, workspace);
+    std::vector<std::string> case_feat;
+    WordsSink sink(words, features, case_feat);
+
+    tokenize_into(input, sink, workspace);
+
+    if (_case_feature)
+      features.push_back(case_feat);
+  }
+
+  void Tokenizer::tokenize(const std::string& text, TokenBatch& batch) const
+  {
+    Workspace workspace;
+    tokenize(text, batch, workspace);
+  }
+
+  void Tokenizer::tokenize(const std::string& text, TokenBatch& batch, Workspace& workspace) const
+  {
+    batch.clear();
+    const StringView input = prepare_text(text, workspace);
+    BatchSink sink(batch);
+    tokenize_into(input, sink, workspace);
+  }
+
+  // Size of the first part of the text tokenized with a maximum number of tokens. The
+  // next parts double in size, so that the text read is at most twice the text needed.
+  static const size_t min_part_size = 256;
+
+  size_t Tokenizer::tokenize(const std::string& text,
+                             TokenBatch& batch,
+                             Workspace& workspace,
+                             size_t max_tokens) const
+  {
+    // The text is prepared and tokenized by parts split where the tokenization state is
+    // reset, as in StreamTokenizer, until a part has tokens left out.
+    batch.clear();
+    BatchSink sink(batch);
+    KernelRegisters registers{0, 0};
+    SplitSearch search{0, false, false};
+    size_t part_size = min_part_size;
+    size_t word_end = 0;  // Position after the last word of the previous parts.
+
+    for (size_t begin = 0; begin < text.size(); part_size *= 2)
+    {
+      size_t end = 0;
+      do
+        end = find_split(text, search);
+      while (end != std::string::npos && end - begin < part_size);
+      if (end == std::string::npos)
+        end = text.size();
+
+      const StringView part = StringView(text).substr(begin, end - begin);
+      if (_throw_on_invalid_utf8)
+      {
+        const size_t invalid = unicode::validate_utf8(part.data(), part.size());
+        if (invalid != part.size())
+          throw std::invalid_argument("Invalid UTF-8 sequence at byte "
+                                      + std::to_string(begin + invalid));
+      }
+
+      const StringView input = prepare_text(part, workspace);
+      const size_t stop = tokenize_into(input, sink, workspace, &registers, max_tokens);
+      if (stop != input.size())
+      {
+        batch.truncate(max_tokens);
+        // No word of this part has all its tokens in batch.
+        if (stop == 0)
+          return word_end;
+        return begin + get_text_offset(part, input, stop, workspace);
+      }
+
+      if (!workspace._spans.empty())
+      {
+        const size_t last_end = get_word_end(input, workspace._spans.back().end);
+        word_end = begin + get_text_offset(part, input, last_end, workspace);
+      }
+      begin = end;
+    }
+
+    return std::string::npos;
+  }
+
+  size_t Tokenizer::count_tokens(const std::string& text) const
+  {
+    Workspace workspace;
+    return count_tokens(text, workspace);
+  }
+
+  size_t Tokenizer::count_tokens(const std::string& text, Workspace& workspace) const
+  {
+    const StringView input = prepare_text(text, workspace);
+    CountSink sink;
+    tokenize_into(input, sink, workspace);
+    return sink.size();
+  }
+
+  void Tokenizer::tokenize(const std::string& text,
+                           std::vector<int32_t>& ids,
+                           const Vocabulary& vocabulary,
+                           Workspace& workspace,
+                           std::vector<CaseModifier::Type>* case_feature) const
+  {
+    ids.clear();
+    if (case_feature)
+      case_feature->clear();
+    const StringView input = prepare_text(text, workspace);
+    IdSink sink(vocabulary, ids, case_feature);
+    tokenize_into(input, sink, workspace);
+  }
+
+  // Parts of the text tokenized by each thread, so that threads are only started for
+  // large texts.
+  static const size_t min_thread_text_size = 64 * 1024;
+
+  void Tokenizer::tokenize(const std::string& text,
+                           TokenBatch& batch,
+                           size_t num_threads) const
+  {
+    const size_t num_parts = std::min(num_threads, text.size() / min_thread_text_size);
+    if (num_parts <= 1)
+    {
+      tokenize(text, batch);
+      return;
+    }
+
+    // Report the position in the whole text.
+    if (_throw_on_invalid_utf8)
+    {
+      const size_t invalid = unicode::validate_utf8(text.data(), text.size());
+      if (invalid != text.size())
+        throw std::invalid_argument("Invalid UTF-8 sequence at byte " + std::to_string(invalid));
+    }
+
+    // Each thread finds the bounds of its part, which are the same for adjacent parts.
+    std::vector<TokenBatch> batches(num_parts - 1);
+    std::vector<std::exception_ptr> errors(num_parts);
+    auto tokenize_part = [&](size_t i)
+    {
+      try
+      {
+        const size_t begin = (i == 0
+                              ? 0
+                              : find_reset_split(text, text.size() / num_parts * i));
+        const size_t end = (i + 1 == num_parts
+                            ? text.size()
+                            : find_reset_split(text, text.size() / num_parts * (i + 1)));
+        TokenBatch& part = i == 0 ? batch : batches[i - 1];
+        part.clear();
+        if (begin < end)
         {
-          bool cur_letter = false;
-          bool cur_number = false;
-          // skip special characters and BOM
-          if (v > 32 and v != 0xFEFF)
-          {
-            if (substitutes.find(c)!=substitutes.end())
-              c = substitutes.at(c);
-            cur_letter = unicode::is_letter(v, type_letter);
-            cur_number = unicode::is_number(v);
-
-            if (unicode::is_mark(v)) {
-              // if we have a mark, we keep type of previous character
-              cur_letter = letter;
-              cur_number = number;
-            }
-
-            if (_mode == Mode::Conservative)
-            {
-              if (cur_number
-                  || (c == "-" && letter)
-                  || (c == "_")
-                  || (letter && (c == "." || c == ",") && (unicode::is_number(next_v) || unicode::is_letter(next_v, type_letter))))
-                cur_letter = true;
-            }
-
-            if (cur_letter)
-            {
-              if ((!letter && !space) ||
-                  (letter && !unicode::is_mark(v) &&
-                    (prev_alphabet == "placeholder" ||
-                     (_segment_case && letter && ((type_letter == unicode::_letter_upper && !uppercase) ||
-                                                  (type_letter == unicode::_letter_lower && uppercase_sequence))))))
-              {
-                if (_joiner_annotate && !_joiner_new)
-                  token += _joiner;
-                words.push_back(token);
-                if (_joiner_annotate && _joiner_new)
-                  words.push_back(_joiner);
-                token.clear();
-                uppercase = (type_letter == unicode::_letter_upper);
-                uppercase_sequence = false;
-              }
-              else if (other && _joiner_annotate && token.empty())
-              {
-                if (_joiner_new)
-                  words.push_back(_joiner);
-                else
-                  words.back() += _joiner;
-                uppercase = (type_letter == unicode::_letter_upper);
-                uppercase_sequence = false;
-              } else {
-                uppercase_sequence = (type_letter == unicode::_letter_upper) & uppercase;
-                uppercase = (type_letter == unicode::_letter_upper);
-              }
-
-              token += c;
-              letter = true;
-              number = false;
-              other = false;
-              space = false;
-              prev_alphabet = "letter";
-            }
-            else if (cur_number)
-            {
-              if (letter || (number && _segment_numbers) || (!number && !space))
-              {
-                bool addjoiner = false;
-                if (_joiner_annotate) {
-                  if (_joiner_new) addjoiner = true;
-                  else {
-                    if (!letter or prev_alphabet == "placeholder")
-                      token += _joiner;
-                    else
-                      c = _joiner + c;
-                  }
-                }
-                words.push_back(token);
-                if (addjoiner) words.push_back(_joiner);
-                token.clear();
-              }
-              else if (other && _joiner_annotate)
-              {
-                if (_joiner_new)
-                  words.push_back(_joiner);
-                else
-                  words[words.size()-1] += _joiner;
-              }
-
-              token += c;
-              letter = false;
-              uppercase = false;
-              uppercase_sequence = false;
-              number = true;
-              other = false;
-              space = false;
-            }
-            else
-            {
-              if (!space)
-              {
-                words.push_back(token);
-                if (_joiner_annotate && _joiner_new)
-                  words.push_back(_joiner);
-                token.clear();
-                if (_joiner_annotate && !_joiner_new)
-                  token += _joiner;
-              }
-              else if (other && _joiner_annotate)
-              {
-                if (_joiner_new)
-                  words.push_back(_joiner);
-                else
-                  token = _joiner;
-              }
-
-              token += c;
-              words.push_back(token);
-              token.clear();
-              letter = false;
-              uppercase = false;
-              uppercase_sequence = false;
-              number = false;
-              other = true;
-              space = true;
-            }
-          }
+          Workspace workspace;
+          const StringView input = prepare_text(StringView(text).substr(begin, end - begin),
+                                                workspace);
+          BatchSink sink(part);
+          tokenize_into(input, sink, workspace);
         }
       }
+      catch (...)
+      {
+        errors[i] = std::current_exception();
+      }
+    };
+
+    std::vector<std::thread> threads;
+    threads.reserve(num_parts - 1);
+    for (size_t i = 1; i < num_parts; ++i)
+      threads.emplace_back(tokenize_part, i);
+    tokenize_part(0);
+    for (auto& thread : threads)
+      thread.join();
 
-      if (!token.empty())
-        words.push_back(token);
+    for (const auto& error : errors)
+    {
+      if (error)
+        std::rethrow_exception(error);
     }
+    for (const auto& part : batches)
+      batch.append(part);
+  }
+
+  void Tokenizer::tokenize_part(StringView text,
+                                TokenBatch& batch,
+                                Workspace& workspace,
+                                KernelRegisters& registers) const
+  {
+    const StringView input = prepare_text(text, workspace);
+    BatchSink sink(batch);
+    tokenize_into(input, sink, workspace, &registers);
+  }
 
-    if (_bpe)
-      words = bpe_segment(words);
+  // The text can be split before a character that follows a separator, when neither
+  // of them is in a placeholder: the tokenization state is then reset, except the
+  // registers that are carried to the next part. The characters must be well-formed so
+  // that invalid sequences are replaced in the same way in both parts, and with
+  // normalization the character after the split must be ASCII so that it does not
+  // combine with the separator.
+  size_t Tokenizer::find_split(StringView text, SplitSearch& search) const
+  {
+    const bool space_mode = _mode == Mode::Space;
+    const bool normalize = _normalize_nfc || _normalize_nfkc;
+    const char* data = text.data();
+    const size_t size = text.size();
 
-    if (_case_feature)
+    while (search.offset < size)
     {
-      std::vector<std::string> case_feat;
+      const size_t i = search.offset;
+      const unsigned char byte = data[i];
+      unsigned int length = 1;
+      unicode::code_point_t c = byte;
+      bool valid = true;
 
-      for (size_t i = 0; i < words.size(); ++i)
+      if (byte >= 0x80)
       {
-        if (words[i].find(ph_marker_open) == std::string::npos)
+        length = unicode::utf8_sequence_length(data + i, size - i);
+        if (length == 0)
         {
-          auto data = CaseModifier::extract_case(words[i]);
-          words[i] = data.first;
-          case_feat.emplace_back(1, data.second);
-        } else
+          // The sequence may be completed by the rest of the text.
+          if (size - i < 4)
+            break;
+          length = 1;
+          valid = false;
+        }
+        else
+          c = unicode::utf8_to_cp(reinterpret_cast<const unsigned char*>(data + i),
+                                  size - i,
+                                  length);
+      }
+
+      bool separator = false;
+      bool split = false;
+      if (valid)
+      {
+        separator = (space_mode
+                     ? c == ' '
+                     : (unicode::get_properties(c) & unicode::_prop_separator) != 0);
+        split = search.after_separator && !separator && (!normalize || byte < 0x80);
+        if (!space_mode)
         {
-          case_feat.emplace_back(1, 'N');
+          if (c == 0xFF5F)
+            search.in_placeholder = true;
+          else if (c == 0xFF60)
+            search.in_placeholder = false;
         }
       }
 
-      features.push_back(case_feat);
+      search.after_separator = separator && !search.in_placeholder;
+      search.offset += length;
+      if (split)
+        return i;
+    }
+
+    return std::string::npos;
+  }
+
+  // After a separator, a letter sets the registers (see KernelRegisters) before they are
+  // read: the part that starts with it does not depend on the previous ones.
+  size_t Tokenizer::find_reset_split(StringView text, size_t offset) const
+  {
+    const unsigned char* data = reinterpret_cast<const unsigned char*>(text.data());
+    const size_t size = text.size();
+
+    // The placeholder state is given by the last marker that starts before offset.
+    SplitSearch search{offset, false, false};
+    if (_mode != Mode::Space)
+    {
+      for (size_t i = offset; i-- > 0;)
+      {
+        if (data[i] == 0xEF && i + 2 < size && data[i + 1] == 0xBD
+            && (data[i + 2] == 0x9F || data[i + 2] == 0xA0))
+        {
+          search.in_placeholder = data[i + 2] == 0x9F;
+          break;
+        }
+      }
+    }
+
+    // Start on the first byte of a character.
+    while (search.offset < size && (data[search.offset] & 0xC0) == 0x80)
+      ++search.offset;
+
+    while (true)
+    {
+      const size_t split = find_split(text, search);
+      if (split == std::string::npos)
+        return size;
+      unsigned int length = 0;
+      const unicode::code_point_t c = unicode::utf8_to_cp(data + split, size - split, length);
+      if (get_char_class(c, unicode::get_properties(c)) == CharClass::Letter)
+        return split;
     }
   }
 
-  std::vector<std::string> Tokenizer::bpe_segment(const std::vector<std::string>& tokens)
+  void Tokenizer::tokenize(StringView text, std::vector<TokenSpan>& spans) const
   {
-    std::vector<std::string> segments;
+    size_t invalid = unicode::validate_utf8(text.data(), text.size());
+    if (invalid != text.size())
+      throw std::invalid_argument("Invalid UTF-8 sequence at byte " + std::to_string(invalid));
 
-    for (size_t i = 0; i < tokens.size(); ++i)
+    if (_mode != Mode::Space)
     {
-      std::string token = tokens[i];
+      tokenize_text(text, spans, nullptr, nullptr, std::string::npos);
+      return;
+    }
 
-      if (token.find(Tokenizer::ph_marker_open) != std::string::npos) {
-        segments.push_back(token);
-        continue;
+    const auto add_field = [this, &text, &spans](StringView field, size_t index) {
+      if (index == 0)
+        spans.push_back(get_space_token_span(text, field));
+    };
+    split_space_tokens(text, std::string::npos, add_field);
+  }
+
+  std::string Tokenizer::get_token_text(StringView text, const TokenSpan& span)
+  {
+    std::string token;
+    append_token_text(text, span, token);
+    return token;
+  }
+
+  // Edge joiners are flags when they are removed before BPE, as for the joiners of
+  // the other modes. A joiner alone stays a token, which joins both sides.
+  TokenSpan Tokenizer::get_space_token_span(StringView text, StringView token) const
+  {
+    const size_t begin = token.data() - text.data();
+    TokenSpan span{begin, begin + token.size(), false, false, false};
+    if (_bpe && (!_joiner_annotate || _joiner_new))
+      return span;
+
+    // Same order as the string detokenizer: the right joiner is removed first.
+    if (token.size() > _joiner.size() && has_right_join(token))
+    {
+      span.end -= _joiner.size();
+      span.joiner_right = true;
+      token = token.substr(0, token.size() - _joiner.size());
+    }
+    if (token.size() > _joiner.size() && has_left_join(token))
+    {
+      span.begin += _joiner.size();
+      span.joiner_left = true;
+    }
+    return span;
+  }
+
+  unicode::InvalidUtf8 Tokenizer::get_invalid_utf8_policy() const
+  {
+    if (_throw_on_invalid_utf8)
+      return unicode::InvalidUtf8::Throw;
+    if (_skip_invalid_utf8)
+      return unicode::InvalidUtf8::Skip;
+    return unicode::InvalidUtf8::Replace;
+  }
+
+  unicode::NormalizationForm Tokenizer::get_normalization_form() const
+  {
+    return _normalize_nfkc ? unicode::NormalizationForm::NFKC : unicode::NormalizationForm::NFC;
+  }
+
+  StringView Tokenizer::prepare_text(StringView text, Workspace& workspace) const
+  {
+    StringView input = text;
+
+    if (unicode::validate_utf8(text.data(), text.size()) != text.size())
+    {
+      workspace._text = unicode::sanitize_utf8(text, get_invalid_utf8_policy());
+      input = workspace._text;
+    }
+
+    if ((_normalize_nfc || _normalize_nfkc)
+        && unicode::normalize(input,
+                              get_normalization_form(),
+                              workspace._normalized,
+                              workspace._normalized_code_points))
+      input = workspace._normalized;
+
+    return input;
+  }
+
+  size_t Tokenizer::get_text_offset(StringView text,
+                                    StringView input,
+                                    size_t offset,
+                                    Workspace& workspace) const
+  {
+    if (input.data() == text.data())
+      return offset;
+
+    StringView sanitized = text;
+    if (unicode::validate_utf8(text.data(), text.size()) != text.size())
+      sanitized = workspace._text;
+    if (input.data() == workspace._normalized.data())
+      offset = unicode::get_unnormalized_offset(sanitized,
+                                                get_normalization_form(),
+                                                offset,
+                                                workspace._normalized_code_points);
+    if (sanitized.data() != text.data())
+      offset = unicode::get_unsanitized_offset(text, get_invalid_utf8_policy(), offset);
+    return offset;
+  }
+
+
+  // In space mode, a word ends after the features of its token.
+  size_t Tokenizer::get_word_end(StringView text, size_t end) const
+  {
+    if (_mode == Mode::Space && end > 0)
+    {
+      const void* space = std::memchr(text.data() + end, ' ', text.size() - end);
+      end = space ? static_cast<const char*>(space) - text.data() : text.size();
+    }
+    return end;
+  }
+
+  template <typename Sink>
+  size_t Tokenizer::tokenize_into(StringView text,
+                                  Sink& sink,
+                                  Workspace& workspace,
+                                  KernelRegisters* registers,
+                                  size_t max_tokens) const
+  {
+    const bool case_feature = _case_feature && Sink::with_case;
+    std::vector<TokenSpan>& spans = workspace._spans;
+    spans.clear();
+
+
+    bool cut = false;
+    if (_mode == Mode::Space)
+    {
+      workspace._case_text.clear();
+      workspace._code_points.clear();
+      const auto add_field = [this, &text, &spans, &sink](StringView field, size_t index) {
+        if (index == 0)
+          spans.push_back(get_space_token_span(text, field));
+        else
+          sink.add_feature(field, index);
+      };
+      cut = split_space_tokens(text, max_tokens, add_field);
+    }
+    else
+    {
+      // Each word gives at least one token: an extra word is enough to know whether
+      // words are left out.
+      tokenize_text(text,
+                    spans,
+                    case_feature || _bpe ? &workspace : nullptr,
+                    registers,
+                    max_tokens == std::string::npos ? std::string::npos : max_tokens + 1);
+    }
+
+    if (case_feature)
+      lowercase_string(_joiner, workspace._case_joiner, workspace._case_joiner_letters);
+
+    // With JoinerNew, joiners are words that are also segmented by BPE.
+    auto add_joiner = [this, &sink, &workspace]() {
+      if (_bpe)
+        add_word(_joiner, std::string::npos, false, false, sink, workspace);
+      else
+        add_token(_joiner,
+                  workspace._case_joiner,
+                  workspace._case_joiner_letters,
+                  false,
+                  false,
+                  sink,
+                  workspace);
+    };
+
+    const auto word_end = [this, &text](size_t end) {
+      return get_word_end(text, end);
+    };
+
+    // The joiners of space mode are kept on their tokens, as written in the text.
+    const bool joiner_new = _joiner_new && _mode != Mode::Space;
+    std::string& token = workspace._token;
+    size_t end = 0;
+    for (const auto& span: spans)
+    {
+      if (sink.size() >= max_tokens)
+        return word_end(end);
+
+      if (span.joiner_left && joiner_new)
+        add_joiner();
+
+      const bool join_left = span.joiner_left && !joiner_new;
+      const bool join_right = span.joiner_right && !joiner_new;
+      if (span.substituted)
+      {
+        token.clear();
+        append_token_text(text, span, token);
+        add_word(token, std::string::npos, join_left, join_right, sink, workspace);
       }
+      else
+        add_word(text.substr(span.begin, span.end - span.begin),
+                 span.begin,
+                 join_left,
+                 join_right,
+                 sink,
+                 workspace);
+
+      if (span.joiner_right && joiner_new)
+        add_joiner();
+
+      if (sink.size() > max_tokens)
+        return word_end(end);
+      end = span.end;
+    }
 
-      bool left_sep = false;
-      bool right_sep = false;
+    return cut ? word_end(end) : text.size();
+  }
+
+  // Adds word with its joiners to the sink, segmented by BPE if a model is set. The
+  // case and code points of word are taken from those recorded for the text during
+  // tokenization when they are available.
+  template <typename Sink>
+  void Tokenizer::add_word(StringView word,
+                           size_t offset,
+                           bool join_left,
+                           bool join_right,
+                           Sink& sink,
+                           Workspace& workspace) const
+  {
+    const bool case_known = (offset != std::string::npos
+                             && offset + word.size() <= workspace._case_text.size());
+    const StringView case_text = workspace._case_text;
+    const StringView case_text_letters = workspace._case_text_letters;
 
-      if (_joiner_annotate && !_joiner_new)
+    // Adds a piece of word starting at piece_offset in the text.
+    auto add_piece = [&](StringView piece, size_t piece_offset, bool left, bool right) {
+      StringView lowercase;
+      StringView letters;
+      if (case_known)
       {
-        if (has_left_join(token))
+        lowercase = case_text.substr(piece_offset, piece.size());
+        letters = case_text_letters.substr(piece_offset, piece.size());
+      }
+      add_token(piece, lowercase, letters, left, right, sink, workspace);
+    };
+
+    if (!_bpe || contains(word, ph_marker_open))
+    {
+      add_piece(word, offset, join_left, join_right);
+      return;
+    }
+
+    std::vector<StringView>& pieces = workspace._bpe_pieces;
+    pieces.clear();
+    if (offset != std::string::npos && offset + word.size() <= workspace._code_points.size())
+      _bpe->encode(word, workspace._code_points.data() + offset, pieces, workspace);
+    else
+      _bpe->encode(word, pieces, workspace);
+
+    for (size_t j = 0; j < pieces.size(); ++j)
+    {
+      const bool join_next = _joiner_annotate && j + 1 < pieces.size();
+      add_piece(pieces[j],
+                offset + (pieces[j].data() - word.data()),
+                join_left && j == 0,
+                (join_right && j + 1 == pieces.size()) || (join_next && !_joiner_new));
+
+      if (join_next && _joiner_new)
+        add_token(_joiner,
+                  workspace._case_joiner,
+                  workspace._case_joiner_letters,
+                  false,
+                  false,
+                  sink,
+                  workspace);
+    }
+  }
+
+  // Adds token and its joiners to the sink, with its lowercase form and case if the case
+  // feature is enabled. Joiners are passed apart and only written by the sink: the case
+  // of the joined token is continued over the letters of the joiners.
+  template <typename Sink>
+  void Tokenizer::add_token(StringView token,
+                            StringView lowercase,
+                            StringView letters,
+                            bool join_left,
+                            bool join_right,
+                            Sink& sink,
+                            Workspace& workspace) const
+  {
+    const StringView joiner = _joiner;
+    const StringView left = join_left ? joiner : StringView();
+    const StringView right = join_right ? joiner : StringView();
+
+    if (!_case_feature || !Sink::with_case)
+      sink.add_token(left, token, right);
+    else if (contains(token, ph_marker_open))
+      sink.add_token(left, token, right, CaseModifier::Type::None);
+    else if (lowercase.size() == token.size()
+             && ((!join_left && !join_right)
+                 || workspace._case_joiner.size() == joiner.size()))
+    {
+      const StringView case_joiner = workspace._case_joiner;
+      const StringView case_joiner_letters = workspace._case_joiner_letters;
+      CaseModifier::Type case_type = CaseModifier::Type::None;
+      if (join_left)
+        case_type = get_case(case_joiner_letters, case_type);
+      case_type = get_case(letters, case_type);
+      if (join_right)
+        case_type = get_case(case_joiner_letters, case_type);
+      sink.add_token(join_left ? case_joiner : StringView(),
+                     lowercase,
+                     join_right ? case_joiner : StringView(),
+                     case_type);
+    }
+    else
+    {
+      // The joiners are lowercased on their own to be split from the lowercase token.
+      std::string& lowercase = workspace._lowercase;
+      lowercase.clear();
+      if (join_left || join_right)
+        CaseModifier::extract_case(joiner, lowercase);
+      const size_t joiner_size = lowercase.size();
+
+      std::string& joined = workspace._piece;
+      joined.clear();
+      joined.append(left.data(), left.size());
+      joined.append(token.data(), token.size());
+      joined.append(right.data(), right.size());
+      lowercase.clear();
+      const CaseModifier::Type case_type = CaseModifier::extract_case(joined, lowercase);
+
+      const StringView lowercase_joined = lowercase;
+      const size_t left_size = join_left ? joiner_size : 0;
+      const size_t token_size = (lowercase_joined.size() - left_size
+                                 - (join_right ? joiner_size : 0));
+      sink.add_token(lowercase_joined.substr(0, left_size),
+                     lowercase_joined.substr(left_size, token_size),
+                     lowercase_joined.substr(left_size + token_size),
+                     case_type);
+    }
+  }
+
+  // Joiners are recorded as flags on the tokens: JoinerNew only changes how they
+  // are rendered in tokenize_into. If workspace is set, the case of the letters (case
+  // feature) and the code points (BPE) are also recorded as the characters are decoded,
+  // except in placeholders which are scanned by find_placeholder_stop: placeholders are
+  // neither segmented by BPE nor annotated with a case. If registers is set, the
+  // registers kept across separators are read from it and saved to it at the end. The
+  // text is not read further once max_spans spans are pushed.
+  void Tokenizer::tokenize_text(StringView text,
+                                std::vector<TokenSpan>& spans,
+                                Workspace* workspace,
+                                KernelRegisters* registers,
+                                size_t max_spans) const
+  {
+    const TransitionTable& table = get_transition_table(_mode, _segment_numbers);
+
+    const bool segment_alphabet = _segment_alphabet_change || !_segment_alphabet.empty();
+    const bool record_case = workspace && _case_feature;
+    const bool record_code_points = workspace && _bpe;
+    if (record_case)
+    {
+      workspace->_case_text.assign(text.data(), text.size());
+      workspace->_case_text_letters.assign(text.size(), 0);
+    }
+    if (record_code_points)
+      workspace->_code_points.resize(text.size());
+
+    TokenBuilder token;
+    State state = State::Space;
+    bool uppercase = false;
+    bool uppercase_sequence = false;
+    unicode::_type_letter type_letter = unicode::_letter_other;
+    int prev_script = unicode::_script_unknown;
+    if (registers)
+    {
+      type_letter = static_cast<unicode::_type_letter>(registers->type_letter);
+      prev_script = registers->prev_script;
+    }
+
+    unicode::Utf8Range chars(text.data(), text.size());
+    unicode::Utf8Iterator next = chars.begin();
+    const unicode::Utf8Iterator end = chars.end();
+    unsigned char next_props = next != end ? unicode::get_properties(next->code_point) : 0;
+
+    while (next != end && spans.size() < max_spans)
+    {
+      const unicode::Utf8Char c = *next;
+      const unsigned char props = next_props;
+      ++next;
+      next_props = next != end ? unicode::get_properties(next->code_point) : 0;
+
+      if (record_case && (props & unicode::_prop_letter))
+        lowercase_letter(c, props, workspace->_case_text, workspace->_case_text_letters);
+      if (record_code_points)
+        workspace->_code_points[c.offset] = c.code_point;
+
+      const CharClass char_class = get_char_class(c.code_point, props);
+      Transition transition = table.get(state, char_class);
+
+      if (transition.action >= Action::LetterAppend && (props & unicode::_prop_letter))
+        type_letter = get_letter_type(props);
+
+      if (transition.action == Action::LetterLookahead)
+      {
+        bool is_letter = false;
+        if (next_props & unicode::_prop_number)
+          is_letter = true;
+        else if (next_props & unicode::_prop_letter)
+        {
+          type_letter = get_letter_type(next_props);
+          is_letter = true;
+        }
+
+        if (!is_letter)
+          transition = {Action::OtherSplit, State::Other};
+        else if (state == State::Letter)
+          transition.action = Action::LetterInWord;
+        else
+          transition.action = Action::LetterSplit;
+      }
+
+      const bool is_upper = type_letter == unicode::_letter_upper;
+
+      switch (transition.action)
+      {
+      case Action::Skip:
+        break;
+
+      case Action::PlaceholderAppendEscaped:
+        token.append_substituted(c.offset, c.length);
+        break;
+
+      case Action::PlaceholderOpen:
+      case Action::PlaceholderAppend:
+      case Action::PlaceholderClose:
+        token.append(c.offset, c.length);
+        break;
+
+      case Action::PlaceholderOpenJoin:
+        if (_joiner_annotate && token.empty())
+          spans.back().joiner_right = true;
+        token.append(c.offset, c.length);
+        break;
+
+      case Action::PlaceholderOpenSplit:
+      case Action::PlaceholderOpenSplitJoinNext:
+        if (_joiner_annotate && transition.action == Action::PlaceholderOpenSplit)
+          token.join_right();
+        token.push(spans, c.offset);
+        if (_joiner_annotate && transition.action == Action::PlaceholderOpenSplitJoinNext)
+          token.join_left();
+        token.append(c.offset, c.length);
+        break;
+
+      case Action::SeparatorSplit:
+        token.push(spans, c.offset);
+        // fall through
+      case Action::Separator:
+        if (_with_separators)
         {
-          token.erase(0, _joiner.size());
-          left_sep = true;
+          token.append(c.offset, c.length);
+          if (!(next_props & unicode::_prop_separator))
+            token.push(spans, c.offset + c.length);
         }
+        uppercase = false;
+        uppercase_sequence = false;
+        break;
 
-        if (has_right_join(token))
+      case Action::LetterAppend:
+      case Action::LetterJoin:
+      case Action::LetterSplit:
+      case Action::LetterInWord:
+      {
+        const bool letter = (state == State::Letter
+                             || state == State::PlaceholderClosed
+                             || state == State::PlaceholderClosedNumber);
+        int script = unicode::_script_common;
+        bool split = transition.action == Action::LetterSplit;
+
+        if (segment_alphabet)
         {
-          token.erase(token.size() - _joiner.size());
-          right_sep = true;
+          script = unicode::get_script(c.code_point);
+          if (transition.action == Action::LetterInWord
+              && script > unicode::_script_inherited
+              && prev_script > unicode::_script_inherited)
+            split = ((_segment_alphabet_change && script != prev_script)
+                     || _segment_alphabet.count(script)
+                     || _segment_alphabet.count(prev_script));
         }
+
+        if (transition.action == Action::LetterInWord && !split && _segment_case)
+          split = ((type_letter == unicode::_letter_upper && !uppercase)
+                   || (type_letter == unicode::_letter_lower && uppercase_sequence));
+
+        if (split)
+        {
+          if (_joiner_annotate)
+            token.join_right();
+          token.push(spans, c.offset);
+          uppercase = is_upper;
+          uppercase_sequence = false;
+        }
+        else if (transition.action == Action::LetterJoin && _joiner_annotate)
+        {
+          spans.back().joiner_right = true;
+          uppercase = is_upper;
+          uppercase_sequence = false;
+        }
+        else
+        {
+          uppercase_sequence = is_upper && uppercase;
+          uppercase = is_upper;
+        }
+
+        if (!letter || script > unicode::_script_inherited)
+          prev_script = script;
+
+        token.append(c.offset, c.length);
+        break;
       }
 
-      auto encoded = _bpe->encode(token);
+      case Action::NumberJoin:
+        if (_joiner_annotate)
+          spans.back().joiner_right = true;
+        token.append(c.offset, c.length);
+        uppercase = false;
+        uppercase_sequence = false;
+        break;
 
-      if (_joiner_annotate && !_joiner_new)
-      {
-        if (left_sep)
-          encoded.front().insert(0, _joiner);
-        if (right_sep)
-          encoded.back().append(_joiner);
+      case Action::NumberSplit:
+      case Action::NumberSplitJoinNext:
+        if (_joiner_annotate && transition.action == Action::NumberSplit)
+          token.join_right();
+        token.push(spans, c.offset);
+        if (_joiner_annotate && transition.action == Action::NumberSplitJoinNext)
+          token.join_left();
+        // fall through
+      case Action::NumberAppend:
+        token.append(c.offset, c.length);
+        uppercase = false;
+        uppercase_sequence = false;
+        break;
+
+      case Action::OtherSplit:
+        token.push(spans, c.offset);
+        if (_joiner_annotate)
+          token.join_left();
+        // fall through
+      case Action::OtherJoin:
+      case Action::OtherAppend:
+        if (transition.action == Action::OtherJoin && _joiner_annotate)
+          token.join_left();
+        if (char_class == CharClass::Substituted)
+          token.append_substituted(c.offset, c.length);
+        else
+          token.append(c.offset, c.length);
+        token.push(spans, c.offset + c.length);
+        uppercase = false;
+        uppercase_sequence = false;
+        break;
+
+      case Action::LetterLookahead:
+        break;
       }
 
-      for (size_t j = 0; j < encoded.size(); ++j)
-      {
-        segments.push_back(encoded[j]);
+      state = transition.next;
 
-        if (_joiner_annotate && j + 1 < encoded.size())
+      // Jump to the next character of the placeholder that goes through the state
+      // machine.
+      if ((state == State::InPlaceholder || state == State::InPlaceholderNumber)
+          && next != end)
+      {
+        const size_t begin = next->offset;
+        const size_t stop = find_placeholder_stop(text, begin);
+        if (stop != begin)
         {
-          if (_joiner_new)
-            segments.push_back(_joiner);
-          else
-            segments.back().append(_joiner);
+          token.append(begin, stop - begin);
+          next = unicode::Utf8Iterator(text.data(), text.size(), stop);
+          next_props = next != end ? unicode::get_properties(next->code_point) : 0;
         }
       }
     }
 
-    return segments;
+    if (!token.empty())
+      token.push(spans, text.size());
+
+    if (registers)
+    {
+      registers->type_letter = type_letter;
+      registers->prev_script = prev_script;
+    }
   }
 
   Tokenizer& Tokenizer::set_joiner(const std::string& joiner)
@@ -446,37 +1829,38 @@ namespace onmt
     return *this;
   }
 
-  Tokenizer& Tokenizer::set_bpe_model(const std::string& model_path, bool cache_model)
+  Tokenizer& Tokenizer::add_alphabet_to_segment(const std::string& alphabet)
   {
-    if (_bpe != nullptr && !_cache_bpe_model)
-    {
-      delete _bpe;
-    }
-
-    if (!model_path.empty())
-    {
-      if (cache_model)
-        _bpe = load_bpe(model_path);
-      else
-        _bpe = new BPE(model_path);
+    int script = unicode::get_script_id(alphabet);
+    if (script < 0)
+      throw std::invalid_argument("Unknown alphabet " + alphabet);
+    _segment_alphabet.insert(script);
+    return *this;
+  }
 
-      _cache_bpe_model = cache_model;
-    }
+  Tokenizer& Tokenizer::set_bpe_model(const std::string& model_path, bool cache_model)
+  {
+    if (model_path.empty())
+      _bpe.reset();
+    else if (cache_model)
+      _bpe = load_bpe(model_path);
+    else
+      _bpe = std::make_shared<BPE>(model_path);
 
     return *this;
   }
 
 
 
-  bool Tokenizer::has_left_join(const std::string& word)
+  bool Tokenizer::has_left_join(StringView word) const
   {
-    return (word.length() >= _joiner.length() && word.substr(0, _joiner.length()) == _joiner);
+    return (word.size() >= _joiner.size() && word.substr(0, _joiner.size()) == _joiner);
   }
 
-  bool Tokenizer::has_right_join(const std::string& word)
+  bool Tokenizer::has_right_join(StringView word) const
   {
-    return (word.length() >= _joiner.length()
-            && word.substr(word.length() - _joiner.length(), _joiner.length()) == _joiner);
+    return (word.size() >= _joiner.size()
+            && word.substr(word.size() - _joiner.size()) == _joiner);
   }
 
 }
@@ -0,0 +1,124 @@
+#include "onmt/Vocabulary.h"
+
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+namespace onmt
+{
+
+  // FNV-1a, continued over the pieces of a token.
+  static uint64_t hash_bytes(StringView bytes, uint64_t hash = 14695981039346656037ULL)
+  {
+    for (const char c : bytes)
+    {
+      hash ^= static_cast<unsigned char>(c);
+      hash *= 1099511628211ULL;
+    }
+    return hash;
+  }
+
+  // Compares the bytes at data with piece and moves data after them.
+  static bool consume(const char*& data, StringView piece)
+  {
+    if (piece.empty())
+      return true;
+    if (std::memcmp(data, piece.data(), piece.size()) != 0)
+      return false;
+    data += piece.size();
+    return true;
+  }
+
+  Vocabulary::Vocabulary(const std::string& path, const std::string& unknown_token)
+    : _offsets(1, 0)
+  {
+    std::ifstream in(path.c_str());
+
+    if (!in.is_open())
+      throw std::invalid_argument("Unable to open vocabulary `" + path + "'");
+
+    std::string line;
+    while (std::getline(in, line))
+    {
+      if (!line.empty() && line.back() == '\r')
+        line.pop_back();
+      const size_t sep = line.find_first_of(" \t");
+      add_token(StringView(line).substr(0, sep));
+    }
+
+    build(unknown_token);
+  }
+
+  Vocabulary::Vocabulary(const std::vector<std::string>& tokens,
+                         const std::string& unknown_token)
+    : _offsets(1, 0)
+  {
+    for (const auto& token : tokens)
+      add_token(token);
+    build(unknown_token);
+  }
+
+  void Vocabulary::add_token(StringView token)
+  {
+    _tokens.append(token.data(), token.size());
+    _offsets.push_back(static_cast<uint32_t>(_tokens.size()));
+  }
+
+  // Indexes the tokens in a table with at least twice as many slots. A token listed
+  // several times keeps its first ID.
+  void Vocabulary::build(const std::string& unknown_token)
+  {
+    size_t num_slots = 16;
+    while (num_slots < (size() + 1) * 2)
+      num_slots *= 2;
+    _slots.assign(num_slots, -1);
+
+    for (size_t id = 0; id < size(); ++id)
+    {
+      const size_t slot = find_slot(StringView(), token(id), StringView());
+      if (_slots[slot] < 0)
+        _slots[slot] = static_cast<int32_t>(id);
+    }
+
+    const size_t slot = find_slot(StringView(), unknown_token, StringView());
+    if (_slots[slot] < 0)
+    {
+      _slots[slot] = static_cast<int32_t>(size());
+      add_token(unknown_token);
+    }
+    _unknown_id = _slots[slot];
+  }
+
+  size_t Vocabulary::find_slot(StringView left, StringView token, StringView right) const
+  {
+    const size_t size = left.size() + token.size() + right.size();
+    const size_t mask = _slots.size() - 1;
+    size_t slot = hash_bytes(right, hash_bytes(token, hash_bytes(left))) & mask;
+
+    while (true)
+    {
+      const int32_t id = _slots[slot];
+      if (id < 0)
+        return slot;
+      const char* candidate = _tokens.data() + _offsets[id];
+      if (_offsets[id + 1] - _offsets[id] == size
+          && consume(candidate, left)
+          && consume(candidate, token)
+          && consume(candidate, right))
+        return slot;
+      slot = (slot + 1) & mask;
+    }
+  }
+
+  int32_t Vocabulary::lookup(StringView token) const
+  {
+    return lookup(StringView(), token, StringView());
+  }
+
+  int32_t Vocabulary::lookup(StringView left, StringView token, StringView right) const
+  {
+    const int32_t id = _slots[find_slot(left, token, right)];
+    return id < 0 ? _unknown_id : id;
+  }
+
+}
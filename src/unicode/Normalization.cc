@@ -0,0 +1,331 @@
+#include "onmt/unicode/Unicode.h"
+
+#include <algorithm>
+
+#include "onmt/unicode/Data.h"
+
+namespace onmt
+{
+  namespace unicode
+  {
+
+    static uint16_t get_normalization_properties(code_point_t u)
+    {
+      if (u > 0x10FFFF)
+        return 0;
+      const code_point_t block_mask = (1 << normalization_block_bits) - 1;
+      return normalization_blocks[(normalization_index[u >> normalization_block_bits]
+                                   << normalization_block_bits)
+                                  | (u & block_mask)];
+    }
+
+    static unsigned int get_combining_class(code_point_t u)
+    {
+      return get_normalization_properties(u) & 0xFF;
+    }
+
+    static bool is_hangul_syllable(code_point_t u)
+    {
+      return u >= hangul_s_base && u < hangul_s_base + hangul_s_count;
+    }
+
+    // Properties of the characters whose quick check value is not Yes in this form.
+    static uint16_t get_not_yes_mask(NormalizationForm form)
+    {
+      return (form == NormalizationForm::NFC
+              ? _norm_nfc_no | _norm_nfc_maybe
+              : _norm_nfkc_no | _norm_nfkc_maybe);
+    }
+
+    // Quick check from UAX #15: returns true if str is known to be normalized, false
+    // if it is not or if it may not be.
+    static bool quick_check(StringView str, NormalizationForm form)
+    {
+      const uint16_t not_yes = get_not_yes_mask(form);
+      const unsigned char* s = reinterpret_cast<const unsigned char*>(str.data());
+      const size_t size = str.size();
+      unsigned int last_ccc = 0;
+      size_t i = 0;
+
+      while (true)
+      {
+        size_t next = skip_ascii(str.data(), size, i);
+        if (next != i)
+          last_ccc = 0;
+        i = next;
+        if (i >= size)
+          return true;
+
+        unsigned int length;
+        code_point_t u = utf8_to_cp(s + i, size - i, length);
+        if (length == 0)
+          return false;
+        i += length;
+
+        uint16_t props = get_normalization_properties(u);
+        unsigned int ccc = props & 0xFF;
+        if ((props & not_yes) || (ccc != 0 && last_ccc > ccc))
+          return false;
+        last_ccc = ccc;
+      }
+    }
+
+    // Returns the full decomposition of u and sets its length, or returns nullptr if u
+    // is not decomposed. Hangul syllables are decomposed by decompose.
+    static const code_point_t* find_decomposition(code_point_t u,
+                                                  bool compatibility,
+                                                  size_t& length)
+    {
+      uint16_t flag = (compatibility
+                       ? _norm_compatibility_decomposition
+                       : _norm_canonical_decomposition);
+      if (!(get_normalization_properties(u) & flag))
+        return nullptr;
+
+      const Decomposition* d = std::lower_bound(
+        decompositions, decompositions + decompositions_size, u,
+        [](const Decomposition& d, code_point_t u) { return d.code_point < u; });
+      const code_point_t* begin = decomposition_code_points + d->offset;
+      if (compatibility)
+        begin += d->canonical_length;
+      length = compatibility ? d->compatibility_length : d->canonical_length;
+      return begin;
+    }
+
+    static void decompose(code_point_t u, bool compatibility, std::vector<code_point_t>& code_points)
+    {
+      if (is_hangul_syllable(u))
+      {
+        code_point_t s = u - hangul_s_base;
+        code_points.push_back(hangul_l_base + s / hangul_n_count);
+        code_points.push_back(hangul_v_base + (s % hangul_n_count) / hangul_t_count);
+        if (s % hangul_t_count != 0)
+          code_points.push_back(hangul_t_base + s % hangul_t_count);
+        return;
+      }
+
+      size_t length = 0;
+      const code_point_t* begin = find_decomposition(u, compatibility, length);
+      if (!begin)
+      {
+        code_points.push_back(u);
+        return;
+      }
+      code_points.insert(code_points.end(), begin, begin + length);
+    }
+
+    // Returns true if u, or the first character of its decomposition, is neither
+    // reordered nor composed with the characters before it: the text before u is then
+    // normalized on its own.
+    static bool has_boundary_before(code_point_t u, NormalizationForm form)
+    {
+      const uint16_t maybe = (form == NormalizationForm::NFC
+                              ? _norm_nfc_maybe
+                              : _norm_nfkc_maybe);
+      uint16_t props = get_normalization_properties(u);
+      if ((props & 0xFF) != 0 || (props & maybe))
+        return false;
+      if (!(props & get_not_yes_mask(form)) || is_hangul_syllable(u))
+        return true;
+
+      size_t length = 0;
+      const code_point_t* decomposition = find_decomposition(u,
+                                                             form == NormalizationForm::NFKC,
+                                                             length);
+      if (!decomposition)
+        return true;
+      props = get_normalization_properties(decomposition[0]);
+      return (props & 0xFF) == 0 && !(props & maybe);
+    }
+
+    // Sorts each sequence of non-starters by combining class, keeping the original order
+    // of characters with the same class.
+    static void reorder(std::vector<code_point_t>& code_points)
+    {
+      for (size_t i = 1; i < code_points.size(); ++i)
+      {
+        code_point_t u = code_points[i];
+        unsigned int ccc = get_combining_class(u);
+        if (ccc == 0)
+          continue;
+
+        size_t j = i;
+        for (; j > 0 && get_combining_class(code_points[j - 1]) > ccc; --j)
+          code_points[j] = code_points[j - 1];
+        code_points[j] = u;
+      }
+    }
+
+    static code_point_t compose_pair(code_point_t first, code_point_t second)
+    {
+      if (first >= hangul_l_base && first < hangul_l_base + hangul_l_count
+          && second >= hangul_v_base && second < hangul_v_base + hangul_v_count)
+        return hangul_s_base + ((first - hangul_l_base) * hangul_v_count
+                                + (second - hangul_v_base)) * hangul_t_count;
+      if (is_hangul_syllable(first) && (first - hangul_s_base) % hangul_t_count == 0
+          && second > hangul_t_base && second < hangul_t_base + hangul_t_count)
+        return first + (second - hangul_t_base);
+
+      const Composition* end = compositions + compositions_size;
+      const Composition* c = std::lower_bound(
+        compositions, end, std::make_pair(first, second),
+        [](const Composition& c, const std::pair<code_point_t, code_point_t>& pair) {
+          return c.first < pair.first || (c.first == pair.first && c.second < pair.second);
+        });
+      if (c != end && c->first == first && c->second == second)
+        return c->composite;
+      return 0;
+    }
+
+    // Canonical composition: each character is combined with the last starter if no
+    // character with the same or a higher combining class is in between.
+    static void compose(std::vector<code_point_t>& code_points)
+    {
+      if (code_points.empty())
+        return;
+
+      size_t starter = 0;
+      // A leading non-starter blocks all compositions until the next starter.
+      unsigned int last_ccc = get_combining_class(code_points[0]) == 0 ? 0 : 256;
+      size_t size = 1;
+
+      for (size_t i = 1; i < code_points.size(); ++i)
+      {
+        code_point_t u = code_points[i];
+        unsigned int ccc = get_combining_class(u);
+
+        if (last_ccc == 0 || last_ccc < ccc)
+        {
+          code_point_t composite = compose_pair(code_points[starter], u);
+          if (composite != 0)
+          {
+            code_points[starter] = composite;
+            continue;
+          }
+        }
+
+        if (ccc == 0)
+          starter = size;
+        last_ccc = ccc;
+        code_points[size++] = u;
+      }
+
+      code_points.resize(size);
+    }
+
+    static void append_utf8(code_point_t u, std::string& str)
+    {
+      if (u < 0x80)
+        str += static_cast<char>(u);
+      else if (u < 0x800)
+      {
+        str += static_cast<char>(0xC0 | (u >> 6));
+        str += static_cast<char>(0x80 | (u & 0x3F));
+      }
+      else if (u < 0x10000)
+      {
+        str += static_cast<char>(0xE0 | (u >> 12));
+        str += static_cast<char>(0x80 | ((u >> 6) & 0x3F));
+        str += static_cast<char>(0x80 | (u & 0x3F));
+      }
+      else
+      {
+        str += static_cast<char>(0xF0 | (u >> 18));
+        str += static_cast<char>(0x80 | ((u >> 12) & 0x3F));
+        str += static_cast<char>(0x80 | ((u >> 6) & 0x3F));
+        str += static_cast<char>(0x80 | (u & 0x3F));
+      }
+    }
+
+    static size_t get_utf8_length(code_point_t u)
+    {
+      return u < 0x80 ? 1 : u < 0x800 ? 2 : u < 0x10000 ? 3 : 4;
+    }
+
+    size_t get_unnormalized_offset(StringView str,
+                                   NormalizationForm form,
+                                   size_t offset,
+                                   std::vector<code_point_t>& code_points)
+    {
+      const bool compatibility = form == NormalizationForm::NFKC;
+      size_t normalized_offset = 0;
+
+      // Characters are normalized by segments that start at a boundary.
+      const Utf8Range chars(str.data(), str.size());
+      Utf8Iterator it = chars.begin();
+      while (it != chars.end())
+      {
+        const size_t begin = it->offset;
+        ++it;
+        while (it != chars.end() && !has_boundary_before(it->code_point, form))
+          ++it;
+        const StringView segment = str.substr(begin, it->offset - begin);
+
+        size_t normalized_size = segment.size();
+        bool changed = false;
+        if (!quick_check(segment, form))
+        {
+          code_points.clear();
+          for (const auto& c: Utf8Range(segment.data(), segment.size()))
+            decompose(c.code_point, compatibility, code_points);
+          reorder(code_points);
+          compose(code_points);
+
+          normalized_size = 0;
+          for (code_point_t u: code_points)
+            normalized_size += get_utf8_length(u);
+          if (normalized_size != segment.size())
+            changed = true;
+          else
+          {
+            size_t i = 0;
+            for (const auto& c: Utf8Range(segment.data(), segment.size()))
+              changed = changed || c.code_point != code_points[i++];
+          }
+        }
+
+        if (!changed && offset <= normalized_offset + normalized_size)
+          return begin + (offset - normalized_offset);
+        if (changed && offset < normalized_offset + normalized_size)
+          return begin;
+        normalized_offset += normalized_size;
+      }
+
+      return str.size();
+    }
+
+    bool normalize(StringView str, NormalizationForm form, std::string& normalized)
+    {
+      std::string result;
+      std::vector<code_point_t> code_points;
+      if (!normalize(str, form, result, code_points))
+        return false;
+      normalized.swap(result);
+      return true;
+    }
+
+    bool normalize(StringView str,
+                   NormalizationForm form,
+                   std::string& normalized,
+                   std::vector<code_point_t>& code_points)
+    {
+      if (quick_check(str, form))
+        return false;
+
+      const bool compatibility = form == NormalizationForm::NFKC;
+      code_points.clear();
+      for (const auto& c: Utf8Range(str.data(), str.size()))
+        decompose(c.code_point, compatibility, code_points);
+
+      reorder(code_points);
+      compose(code_points);
+
+      normalized.clear();
+      for (code_point_t u: code_points)
+        append_utf8(u, normalized);
+
+      return StringView(normalized) != str;
+    }
+
+  }
+}
@@ -1,4 +1,5 @@
 #include "onmt/unicode/Unicode.h"
+
 #include "onmt/unicode/Data.h"
 
 namespace onmt
@@ -88,165 +89,102 @@ namespace onmt
       return 0; // Incorrect unicode
     }
 
-    std::vector<std::string> split_utf8(const std::string& str, const std::string& sep)
-    {
-      std::vector<std::string> chars;
-      std::vector<code_point_t> code_points;
-
-      explode_utf8(str, chars, code_points);
-
-      std::vector<std::string> fragments;
-      std::string fragment;
-
-      for (size_t i = 0; i < chars.size(); ++i)
-      {
-        if (chars[i] == sep)
-        {
-          fragments.push_back(fragment);
-          fragment.clear();
-        }
-        else
-        {
-          fragment += chars[i];
-        }
-      }
-
-      if (!fragment.empty() || chars.back() == sep)
-        fragments.push_back(fragment);
-
-      return fragments;
-    }
-
-    void explode_utf8(std::string str,
+    void explode_utf8(const std::string& str,
                       std::vector<std::string>& chars,
                       std::vector<code_point_t>& code_points)
     {
-      size_t offset = 0;
-
-      while (offset < str.length())
+      for (const auto& c: Utf8Range(str))
       {
-        unsigned int char_size = 0;
-        code_point_t code_point = utf8_to_cp(reinterpret_cast<const unsigned char*>(str.c_str()),
-                                                     char_size);
-
-        code_points.push_back(code_point);
-        chars.emplace_back(str.substr(0, char_size));
-        str.erase(0, char_size);
+        code_points.push_back(c.code_point);
+        chars.emplace_back(str, c.offset, c.length);
       }
     }
 
-    size_t utf8len(std::string str)
-    {
-      std::vector<std::string> chars;
-      std::vector<unicode::code_point_t> code_points;
-      unicode::explode_utf8(str, chars, code_points);
-      return chars.size();
-    }
+    static const code_point_t max_code_point = 0x10FFFF;
 
-    static bool _find_codepoint(code_point_t u, const map_of_list_t &map)
+    unsigned char get_properties(code_point_t u)
     {
-      map_of_list_t::const_iterator it = map.begin();
-
-      while (it != map.end())
-      {
-        if (u >= it->first)
-        {
-          unsigned int idx = ((u - it->first) >> 4);
-          if (idx < it->second.size())
-          {
-            unsigned int p = (u - it->first) & 0xf;
-            return (((it->second[idx] << p)) & 0x8000);
-          }
-        }
-
-        it++;
-      }
-
-      return 0;
+      if (u > max_code_point)
+        return 0;
+      const code_point_t block_mask = (1 << properties_block_bits) - 1;
+      return properties_blocks[(properties_index[u >> properties_block_bits] << properties_block_bits)
+                               | (u & block_mask)];
     }
 
     bool is_separator(code_point_t u)
     {
-      if (!u)
-        return false;
-      return (u >= 9 and u <= 13) or _find_codepoint(u, unidata_Separator);
+      return get_properties(u) & _prop_separator;
     }
 
     bool is_letter(code_point_t u, _type_letter &tl)
     {
-      if (!u)
+      unsigned char props = get_properties(u);
+      if (!(props & _prop_letter))
         return false;
-      // unicode letter or CJK Unified Ideograph
-      if ((u>=0x4E00 && u<=0x9FD5) // CJK Unified Ideograph
-          || (u>=0x2F00 && u<=0x2FD5) // Kangxi Radicals
-          || (u>=0x2E80 && u<=0x2EFF) // CJK Radicals Supplement
-          || (u>=0x3040 && u<=0x319F) // Hiragana, Katakana, Bopomofo, Hangul Compatibility Jamo, Kanbun
-          || (u>=0x1100 && u<=0x11FF) // Hangul Jamo
-          || (u>=0xAC00 && u<=0xD7AF) // Hangul Syllables
-          || _find_codepoint(u, unidata_LetterOther))
-      {
-        tl = _letter_other;
-        return 1;
-      }
-      if (_find_codepoint(u, unidata_LetterLower))
-      {
+      if (props & _prop_letter_lower)
         tl = _letter_lower;
-        return 1;
-      }
-      if (_find_codepoint(u, unidata_LetterUpper))
-      {
+      else if (props & _prop_letter_upper)
         tl = _letter_upper;
-        return 1;
-      }
-
-      return 0;
+      else
+        tl = _letter_other;
+      return true;
     }
 
     bool is_number(code_point_t u)
     {
-      if (!u)
-        return false;
-      return _find_codepoint(u, unidata_Number);
+      return get_properties(u) & _prop_number;
     }
 
     bool is_mark(code_point_t u)
     {
-      if (!u)
-        return false;
-      return _find_codepoint(u, unidata_Mark);
+      return get_properties(u) & _prop_mark;
     }
 
-    // convert unicode character to lowercase form if defined in unicodedata
-    code_point_t get_lower(code_point_t u)
+    int get_script(code_point_t u)
     {
-      map_unicode::const_iterator it = map_lower.find(u);
-      if (it == map_lower.end())
-        return 0;
-      return it->second;
+      if (u > max_code_point)
+        return _script_unknown;
+      const code_point_t block_mask = (1 << script_block_bits) - 1;
+      return script_blocks[(script_index[u >> script_block_bits] << script_block_bits)
+                           | (u & block_mask)];
     }
 
-    // convert unicode character to uppercase form if defined in unicodedata
-    // dynamically reverse maplower if necessary
-    static map_unicode map_upper;
-
-    code_point_t get_upper(code_point_t u)
+    int get_script_id(const std::string& name)
     {
-      if (map_upper.size() == 0)
+      for (size_t i = 0; i < scripts_size; ++i)
       {
-        map_unicode::const_iterator it;
-        for (it = map_lower.begin(); it != map_lower.end(); it++)
-        {
-          map_unicode::const_iterator jt = map_upper.find(it->second);
-          // reversing, we find smallest codepoint
-          if (jt == map_upper.end() || jt->second>it->first)
-            map_upper[it->second] = it->first;
-        }
+        if (name == script_names[i])
+          return i;
       }
+      return -1;
+    }
 
-      map_unicode::const_iterator it = map_upper.find(u);
-      if (it == map_upper.end())
+    static code_point_t map_case(code_point_t u,
+                                 const uint16_t* latin1,
+                                 const uint16_t* index,
+                                 const int32_t* blocks)
+    {
+      if (u < 0x100)
+        return latin1[u];
+      if (u > case_max_code_point)
+        return 0;
+      const code_point_t block_mask = (1 << case_block_bits) - 1;
+      int32_t delta = blocks[(index[u >> case_block_bits] << case_block_bits) | (u & block_mask)];
+      if (delta == 0)
         return 0;
-      return it->second;
+      return static_cast<code_point_t>(static_cast<int32_t>(u) + delta);
+    }
+
+    // convert unicode character to lowercase form if defined in unicodedata
+    code_point_t get_lower(code_point_t u)
+    {
+      return map_case(u, lower_latin1, lower_index, lower_blocks);
+    }
+
+    // convert unicode character to uppercase form if defined in unicodedata
+    code_point_t get_upper(code_point_t u)
+    {
+      return map_case(u, upper_latin1, upper_index, upper_blocks);
     }
 
   }
@@ -0,0 +1,456 @@
+#include "onmt/unicode/Unicode.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#  include <emmintrin.h>
+#  define ONMT_UTF8_SSE2
+#  if (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))) \
+  || defined(__clang__)
+#    include <immintrin.h>
+#    define ONMT_UTF8_RUNTIME_DISPATCH
+#  endif
+#endif
+
+namespace onmt
+{
+  namespace unicode
+  {
+
+    static inline bool is_continuation(unsigned char c)
+    {
+      return (c & 0xC0) == 0x80;
+    }
+
+    // Length of the maximal subpart of an ill-formed sequence, i.e. the longest
+    // prefix of a well-formed sequence, which is replaced by a single U+FFFD.
+    static unsigned int invalid_length(const unsigned char* s, size_t size)
+    {
+      unsigned char c = s[0];
+      unsigned int expected = 0;
+      unsigned char low = 0x80;
+      unsigned char high = 0xBF;
+
+      if (c >= 0xC2 && c < 0xE0)
+        expected = 2;
+      else if (c >= 0xE0 && c < 0xF0)
+      {
+        expected = 3;
+        if (c == 0xE0)
+          low = 0xA0;
+        else if (c == 0xED)
+          high = 0x9F;
+      }
+      else if (c >= 0xF0 && c < 0xF5)
+      {
+        expected = 4;
+        if (c == 0xF0)
+          low = 0x90;
+        else if (c == 0xF4)
+          high = 0x8F;
+      }
+
+      unsigned int length = 1;
+      if (expected > 1 && length < size && s[length] >= low && s[length] <= high)
+      {
+        ++length;
+        while (length < expected && length < size && is_continuation(s[length]))
+          ++length;
+      }
+      return length;
+    }
+
+    size_t skip_ascii(const char* data, size_t size, size_t i)
+    {
+      const unsigned char* s = reinterpret_cast<const unsigned char*>(data);
+#ifdef ONMT_UTF8_SSE2
+      for (; i + 16 <= size; i += 16)
+      {
+        int mask = _mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i)));
+        if (mask != 0)
+        {
+          while (s[i] < 0x80)
+            ++i;
+          return i;
+        }
+      }
+#else
+      for (; i + 8 <= size; i += 8)
+      {
+        uint64_t word;
+        std::memcpy(&word, s + i, sizeof (word));
+        if (word & 0x8080808080808080ULL)
+          break;
+      }
+#endif
+      while (i < size && s[i] < 0x80)
+        ++i;
+      return i;
+    }
+
+    size_t skip_ascii_non_space(const char* data, size_t size, size_t i)
+    {
+      const signed char* s = reinterpret_cast<const signed char*>(data);
+#ifdef ONMT_UTF8_SSE2
+      // As signed bytes, non-ASCII bytes are negative: a single comparison finds the
+      // bytes that are not above the space.
+      const __m128i space = _mm_set1_epi8(0x20);
+      for (; i + 16 <= size; i += 16)
+      {
+        __m128i input = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+        if (_mm_movemask_epi8(_mm_cmpgt_epi8(input, space)) != 0xFFFF)
+          break;
+      }
+#endif
+      while (i < size && s[i] > 0x20)
+        ++i;
+      return i;
+    }
+
+    static size_t validate_utf8_scalar(const unsigned char* s, size_t size, size_t i)
+    {
+      while (true)
+      {
+        i = skip_ascii(reinterpret_cast<const char*>(s), size, i);
+        if (i >= size)
+          return size;
+        unsigned int length = utf8_sequence_length(s + i, size - i);
+        if (length == 0)
+          return i;
+        i += length;
+      }
+    }
+
+    // Position of the first byte of the character containing the byte before i.
+    static size_t last_boundary(const unsigned char* s, size_t i)
+    {
+      size_t j = i;
+      while (j > 0 && i - j < 4)
+      {
+        --j;
+        if (!is_continuation(s[j]))
+          return j;
+      }
+      return i;
+    }
+
+#ifdef ONMT_UTF8_RUNTIME_DISPATCH
+
+    // Vectorized validation from Keiser and Lemire, "Validating UTF-8 In Less Than One
+    // Instruction Per Byte" (2021). Each error class is a bit that is set in the three
+    // lookups only if the corresponding pair of bytes is invalid.
+    enum
+    {
+      TOO_SHORT = 1 << 0,       // 11______ 0_______ or 11______ 11______
+      TOO_LONG = 1 << 1,        // 0_______ 10______
+      OVERLONG_3 = 1 << 2,      // 11100000 100_____
+      TOO_LARGE = 1 << 3,       // 11110100 1001____, 11110100 101_____, 11110101+ 1001____ ...
+      SURROGATE = 1 << 4,       // 11101101 101_____
+      OVERLONG_2 = 1 << 5,      // 1100000_ 10______
+      TOO_LARGE_1000 = 1 << 6,  // 11110101+ 1000____
+      OVERLONG_4 = 1 << 6,      // 11110000 1000____
+      TWO_CONTS = 1 << 7,       // 10______ 10______
+      CARRY = TOO_SHORT | TOO_LONG | TWO_CONTS
+    };
+
+#define ONMT_BYTE_1_HIGH_TABLE                                          \
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,                             \
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,                             \
+    TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,                         \
+    TOO_SHORT | OVERLONG_2,                                             \
+    TOO_SHORT,                                                          \
+    TOO_SHORT | OVERLONG_3 | SURROGATE,                                 \
+    static_cast<char>(TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4)
+
+#define ONMT_BYTE_1_LOW_TABLE                                           \
+    static_cast<char>(CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4),     \
+    static_cast<char>(CARRY | OVERLONG_2),                              \
+    static_cast<char>(CARRY),                                           \
+    static_cast<char>(CARRY),                                           \
+    static_cast<char>(CARRY | TOO_LARGE),                               \
+    static_cast<char>(CARRY | TOO_LARGE | TOO_LARGE_1000),              \
+    static_cast<char>(CARRY | TOO_LARGE | TOO_LARGE_1000),              \
+    static_cast<char>(CARRY | TOO_LARGE | TOO_LARGE_1000),              \
+    static_cast<char>(CARRY | TOO_LARGE | TOO_LARGE_1000),              \
+    static_cast<char>(CARRY | TOO_LARGE | TOO_LARGE_1000),              \
+    static_cast<char>(CARRY | TOO_LARGE | TOO_LARGE_1000),              \
+    static_cast<char>(CARRY | TOO_LARGE | TOO_LARGE_1000),              \
+    static_cast<char>(CARRY | TOO_LARGE | TOO_LARGE_1000),              \
+    static_cast<char>(CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE),  \
+    static_cast<char>(CARRY | TOO_LARGE | TOO_LARGE_1000),              \
+    static_cast<char>(CARRY | TOO_LARGE | TOO_LARGE_1000)
+
+#define ONMT_BYTE_2_HIGH_TABLE                                                          \
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,                                         \
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,                                         \
+    static_cast<char>(TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4), \
+    static_cast<char>(TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE),     \
+    static_cast<char>(TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE),      \
+    static_cast<char>(TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE),      \
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT
+
+    __attribute__((target("sse4.1")))
+    static size_t validate_utf8_sse4(const unsigned char* s, size_t size)
+    {
+      const __m128i byte_1_high_table = _mm_setr_epi8(ONMT_BYTE_1_HIGH_TABLE);
+      const __m128i byte_1_low_table = _mm_setr_epi8(ONMT_BYTE_1_LOW_TABLE);
+      const __m128i byte_2_high_table = _mm_setr_epi8(ONMT_BYTE_2_HIGH_TABLE);
+      const __m128i nibble_mask = _mm_set1_epi8(0x0F);
+      const __m128i third_byte = _mm_set1_epi8(0xE0 - 0x80);
+      const __m128i fourth_byte = _mm_set1_epi8(0xF0 - 0x80);
+      const __m128i high_bit = _mm_set1_epi8(static_cast<char>(0x80));
+      // Sequences starting in the last 3 bytes of a block that continue in the next one.
+      const __m128i incomplete_max = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1,
+                                                   -1, -1, -1, -1, -1,
+                                                   static_cast<char>(0xF0 - 1),
+                                                   static_cast<char>(0xE0 - 1),
+                                                   static_cast<char>(0xC0 - 1));
+
+      __m128i prev_input = _mm_setzero_si128();
+      __m128i prev_incomplete = _mm_setzero_si128();
+      size_t i = 0;
+
+      for (; i + 16 <= size; i += 16)
+      {
+        __m128i input = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+        __m128i error;
+
+        if (_mm_movemask_epi8(input) == 0)
+        {
+          error = prev_incomplete;
+          prev_incomplete = _mm_setzero_si128();
+        }
+        else
+        {
+          __m128i prev1 = _mm_alignr_epi8(input, prev_input, 15);
+          __m128i prev2 = _mm_alignr_epi8(input, prev_input, 14);
+          __m128i prev3 = _mm_alignr_epi8(input, prev_input, 13);
+
+          __m128i byte_1_high = _mm_shuffle_epi8(
+            byte_1_high_table, _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble_mask));
+          __m128i byte_1_low = _mm_shuffle_epi8(
+            byte_1_low_table, _mm_and_si128(prev1, nibble_mask));
+          __m128i byte_2_high = _mm_shuffle_epi8(
+            byte_2_high_table, _mm_and_si128(_mm_srli_epi16(input, 4), nibble_mask));
+          __m128i special_cases = _mm_and_si128(_mm_and_si128(byte_1_high, byte_1_low),
+                                                byte_2_high);
+
+          __m128i must_be_continuation = _mm_or_si128(_mm_subs_epu8(prev2, third_byte),
+                                                      _mm_subs_epu8(prev3, fourth_byte));
+          error = _mm_xor_si128(_mm_and_si128(must_be_continuation, high_bit), special_cases);
+          prev_incomplete = _mm_subs_epu8(input, incomplete_max);
+        }
+
+        if (!_mm_testz_si128(error, error))
+          return validate_utf8_scalar(s, size, last_boundary(s, i));
+        prev_input = input;
+      }
+
+      return validate_utf8_scalar(s, size, last_boundary(s, i));
+    }
+
+    __attribute__((target("avx2")))
+    static size_t validate_utf8_avx2(const unsigned char* s, size_t size)
+    {
+      const __m256i byte_1_high_table = _mm256_setr_epi8(ONMT_BYTE_1_HIGH_TABLE,
+                                                         ONMT_BYTE_1_HIGH_TABLE);
+      const __m256i byte_1_low_table = _mm256_setr_epi8(ONMT_BYTE_1_LOW_TABLE,
+                                                        ONMT_BYTE_1_LOW_TABLE);
+      const __m256i byte_2_high_table = _mm256_setr_epi8(ONMT_BYTE_2_HIGH_TABLE,
+                                                         ONMT_BYTE_2_HIGH_TABLE);
+      const __m256i nibble_mask = _mm256_set1_epi8(0x0F);
+      const __m256i third_byte = _mm256_set1_epi8(0xE0 - 0x80);
+      const __m256i fourth_byte = _mm256_set1_epi8(0xF0 - 0x80);
+      const __m256i high_bit = _mm256_set1_epi8(static_cast<char>(0x80));
+      const __m256i incomplete_max = _mm256_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1,
+                                                      -1, -1, -1, -1, -1, -1, -1, -1,
+                                                      -1, -1, -1, -1, -1, -1, -1, -1,
+                                                      -1, -1, -1, -1, -1,
+                                                      static_cast<char>(0xF0 - 1),
+                                                      static_cast<char>(0xE0 - 1),
+                                                      static_cast<char>(0xC0 - 1));
+
+      __m256i prev_input = _mm256_setzero_si256();
+      __m256i prev_incomplete = _mm256_setzero_si256();
+      size_t i = 0;
+
+      for (; i + 32 <= size; i += 32)
+      {
+        __m256i input = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i));
+        __m256i error;
+
+        if (_mm256_movemask_epi8(input) == 0)
+        {
+          error = prev_incomplete;
+          prev_incomplete = _mm256_setzero_si256();
+        }
+        else
+        {
+          // Bytes 16 to 31 of prev_input followed by bytes 0 to 15 of input.
+          __m256i shifted = _mm256_permute2x128_si256(prev_input, input, 0x21);
+          __m256i prev1 = _mm256_alignr_epi8(input, shifted, 15);
+          __m256i prev2 = _mm256_alignr_epi8(input, shifted, 14);
+          __m256i prev3 = _mm256_alignr_epi8(input, shifted, 13);
+
+          __m256i byte_1_high = _mm256_shuffle_epi8(
+            byte_1_high_table, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble_mask));
+          __m256i byte_1_low = _mm256_shuffle_epi8(
+            byte_1_low_table, _mm256_and_si256(prev1, nibble_mask));
+          __m256i byte_2_high = _mm256_shuffle_epi8(
+            byte_2_high_table, _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble_mask));
+          __m256i special_cases = _mm256_and_si256(_mm256_and_si256(byte_1_high, byte_1_low),
+                                                   byte_2_high);
+
+          __m256i must_be_continuation = _mm256_or_si256(_mm256_subs_epu8(prev2, third_byte),
+                                                         _mm256_subs_epu8(prev3, fourth_byte));
+          error = _mm256_xor_si256(_mm256_and_si256(must_be_continuation, high_bit),
+                                   special_cases);
+          prev_incomplete = _mm256_subs_epu8(input, incomplete_max);
+        }
+
+        if (!_mm256_testz_si256(error, error))
+          return validate_utf8_scalar(s, size, last_boundary(s, i));
+        prev_input = input;
+      }
+
+      return validate_utf8_scalar(s, size, last_boundary(s, i));
+    }
+
+#undef ONMT_BYTE_1_HIGH_TABLE
+#undef ONMT_BYTE_1_LOW_TABLE
+#undef ONMT_BYTE_2_HIGH_TABLE
+
+#endif
+
+    std::vector<StringView> split_utf8(StringView str, StringView sep)
+    {
+      std::vector<StringView> fragments;
+      if (str.empty())
+        return fragments;
+      if (sep.empty())
+      {
+        fragments.push_back(str);
+        return fragments;
+      }
+
+      // As UTF-8 is self-synchronizing, a byte match of a valid separator is always
+      // aligned on characters.
+      const char* begin = str.data();
+      const char* end = begin + str.size();
+      const char* fragment_start = begin;
+      const char* p = begin;
+
+      while (static_cast<size_t>(end - p) >= sep.size())
+      {
+        p = static_cast<const char*>(std::memchr(p, sep[0], end - p - sep.size() + 1));
+        if (!p)
+          break;
+        if (std::memcmp(p + 1, sep.data() + 1, sep.size() - 1) == 0)
+        {
+          fragments.emplace_back(fragment_start, p - fragment_start);
+          p += sep.size();
+          fragment_start = p;
+        }
+        else
+          ++p;
+      }
+
+      fragments.emplace_back(fragment_start, end - fragment_start);
+      return fragments;
+    }
+
+    size_t utf8len(StringView str)
+    {
+      // Count the bytes that are not continuation bytes (10xxxxxx).
+      const signed char* s = reinterpret_cast<const signed char*>(str.data());
+      size_t size = str.size();
+      size_t length = 0;
+      size_t i = 0;
+#ifdef ONMT_UTF8_SSE2
+      const __m128i max_continuation = _mm_set1_epi8(static_cast<char>(0xBF));
+      const __m128i zero = _mm_setzero_si128();
+      while (i + 16 <= size)
+      {
+        // Per byte counters are summed every 255 iterations at most to avoid overflows.
+        __m128i counts = _mm_setzero_si128();
+        for (size_t n = 0; n < 255 && i + 16 <= size; ++n, i += 16)
+        {
+          __m128i input = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+          counts = _mm_sub_epi8(counts, _mm_cmpgt_epi8(input, max_continuation));
+        }
+        __m128i sums = _mm_sad_epu8(counts, zero);
+        length += _mm_cvtsi128_si32(sums) + _mm_cvtsi128_si32(_mm_srli_si128(sums, 8));
+      }
+#endif
+      for (; i < size; ++i)
+        length += s[i] > static_cast<signed char>(0xBF);
+      return length;
+    }
+
+    size_t validate_utf8(const char* data, size_t size)
+    {
+      const unsigned char* s = reinterpret_cast<const unsigned char*>(data);
+#ifdef ONMT_UTF8_RUNTIME_DISPATCH
+      static const bool has_avx2 = __builtin_cpu_supports("avx2");
+      static const bool has_sse4 = __builtin_cpu_supports("sse4.1");
+      if (has_avx2)
+        return validate_utf8_avx2(s, size);
+      if (has_sse4)
+        return validate_utf8_sse4(s, size);
+#endif
+      return validate_utf8_scalar(s, size, 0);
+    }
+
+    std::string sanitize_utf8(StringView str, InvalidUtf8 policy)
+    {
+      const unsigned char* s = reinterpret_cast<const unsigned char*>(str.data());
+      size_t size = str.size();
+      size_t invalid = validate_utf8(str.data(), size);
+
+      if (invalid == size)
+        return str.to_string();
+      if (policy == InvalidUtf8::Throw)
+        throw std::invalid_argument("Invalid UTF-8 sequence at byte " + std::to_string(invalid));
+
+      std::string sanitized;
+      sanitized.reserve(size + 2);
+      size_t start = 0;
+
+      while (invalid < size)
+      {
+        sanitized.append(str.data() + start, invalid - start);
+        if (policy == InvalidUtf8::Replace)
+          sanitized += "\xEF\xBF\xBD";
+        start = invalid + invalid_length(s + invalid, size - invalid);
+        invalid = validate_utf8_scalar(s, size, start);
+      }
+
+      sanitized.append(str.data() + start, size - start);
+      return sanitized;
+    }
+
+    size_t get_unsanitized_offset(StringView str, InvalidUtf8 policy, size_t offset)
+    {
+      const unsigned char* s = reinterpret_cast<const unsigned char*>(str.data());
+      const size_t size = str.size();
+      const size_t replacement_size = policy == InvalidUtf8::Replace ? 3 : 0;
+      size_t start = 0;
+      size_t sanitized_offset = 0;  // Position of start in the sanitized string.
+
+      while (true)
+      {
+        const size_t invalid = validate_utf8_scalar(s, size, start);
+        if (offset - sanitized_offset <= invalid - start || invalid == size)
+          return std::min(start + (offset - sanitized_offset), invalid);
+        sanitized_offset += invalid - start;
+        start = invalid + invalid_length(s + invalid, size - invalid);
+        if (offset < sanitized_offset + replacement_size)
+          return invalid;
+        sanitized_offset += replacement_size;
+      }
+    }
+
+  }
+}
@@ -1,13 +1,136 @@
+#include <cstdlib>
 #include <memory>
+#include <new>
+#include <thread>
 
 #include <gtest/gtest.h>
 
+#include <onmt/BPE.h>
+#include <onmt/SpaceTokenizer.h>
+#include <onmt/StreamTokenizer.h>
+#include <onmt/TokenizedText.h>
 #include <onmt/Tokenizer.h>
+#include <onmt/unicode/Unicode.h>
 
 using namespace onmt;
 
 static std::string data_dir;
 
+// Count allocations to check that the workspace API does not allocate. All the
+// replaceable allocation functions are replaced so that each pair uses malloc and free.
+static bool count_allocations = false;
+static size_t num_allocations = 0;
+
+static void* allocate(size_t size) {
+  if (count_allocations)
+    ++num_allocations;
+  void* ptr = std::malloc(size == 0 ? 1 : size);
+  if (!ptr)
+    throw std::bad_alloc();
+  return ptr;
+}
+
+void* operator new(size_t size) {
+  return allocate(size);
+}
+
+void* operator new[](size_t size) {
+  return allocate(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+  try {
+    return allocate(size);
+  } catch (const std::bad_alloc&) {
+    return nullptr;
+  }
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+  return operator new(size, std::nothrow);
+}
+
+void operator delete(void* ptr) noexcept {
+  std::free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+  std::free(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+  std::free(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+  std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+  std::free(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept {
+  std::free(ptr);
+}
+
+// Over-aligned types (C++17).
+#if defined(__cpp_aligned_new) && !defined(_WIN32)
+static void* allocate(size_t size, std::align_val_t alignment) {
+  if (count_allocations)
+    ++num_allocations;
+  const size_t align = static_cast<size_t>(alignment);
+  void* ptr = std::aligned_alloc(align, (size + align - 1) / align * align);
+  if (!ptr)
+    throw std::bad_alloc();
+  return ptr;
+}
+
+void* operator new(size_t size, std::align_val_t alignment) {
+  return allocate(size, alignment);
+}
+
+void* operator new[](size_t size, std::align_val_t alignment) {
+  return allocate(size, alignment);
+}
+
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+  try {
+    return allocate(size, alignment);
+  } catch (const std::bad_alloc&) {
+    return nullptr;
+  }
+}
+
+void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+  return operator new(size, alignment, std::nothrow);
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept {
+  std::free(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t) noexcept {
+  std::free(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept {
+  std::free(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept {
+  std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t, std::align_val_t) noexcept {
+  std::free(ptr);
+}
+
+void operator delete[](void* ptr, size_t, std::align_val_t) noexcept {
+  std::free(ptr);
+}
+#endif
+
 static std::string get_data(const std::string& path) {
   return data_dir + "/" + path;
 }
@@ -30,6 +153,33 @@ static void test_tok_and_detok(std::unique_ptr<ITokenizer>& tokenizer,
   return test_tok(tokenizer, in, expected, true);
 }
 
+// Checks that calling function does not allocate memory.
+template <typename Function>
+static void expect_no_allocation(Function function) {
+  num_allocations = 0;
+  count_allocations = true;
+  function();
+  count_allocations = false;
+  EXPECT_EQ(0, num_allocations);
+}
+
+// Checks that actual has the tokens, joiners, case feature and features of expected.
+static void expect_same_tokens(const TokenBatch& expected, const TokenBatch& actual) {
+  ASSERT_EQ(expected.size(), actual.size());
+  for (size_t i = 0; i < expected.size(); ++i) {
+    EXPECT_EQ(expected.token(i), actual.token(i));
+    EXPECT_EQ(expected.joiner_left(i), actual.joiner_left(i));
+    EXPECT_EQ(expected.joiner_right(i), actual.joiner_right(i));
+  }
+  EXPECT_EQ(expected.case_feature(), actual.case_feature());
+  ASSERT_EQ(expected.num_features(), actual.num_features());
+  for (size_t j = 0; j < expected.num_features(); ++j) {
+    ASSERT_EQ(expected.feature(j).size(), actual.feature(j).size());
+    for (size_t i = 0; i < expected.feature(j).size(); ++i)
+      EXPECT_EQ(expected.feature(j)[i], actual.feature(j)[i]);
+  }
+}
+
 TEST(TokenizerTest, BasicConservative) {
   auto tokenizer = std::unique_ptr<ITokenizer>(
     new Tokenizer(Tokenizer::Mode::Conservative));
@@ -76,6 +226,13 @@ TEST(TokenizerTest, ProtectedSequence) {
   test_tok_and_detok(tokenizer, "｟0.23｠$", "｟0.23｠ ￭$");
   test_tok_and_detok(tokenizer, "｟US$｠23", "｟US$｠￭ 23");
   test_tok_and_detok(tokenizer, "1｟ABCD｠0", "1 ￭｟ABCD｠￭ 0");
+  // Separators are escaped with their hexadecimal code point.
+  test_tok(tokenizer, "｟a b\u00A0c\u3000d｠", "｟a％0020b％00a0c％3000d｠");
+  test_tok(tokenizer,
+           "｟https://example.com/a?b=c&d=中文 😀　end｠.",
+           "｟https://example.com/a?b=c&d=中文％0020😀％3000end｠ ￭.");
+  // An unclosed placeholder extends to the end of the text.
+  test_tok(tokenizer, "x ｟abc def", "x ｟abc％0020def");
 }
 
 TEST(TokenizerTest, ProtectedSequenceAggressive) {
@@ -127,6 +284,29 @@ TEST(TokenizerTest, CaseFeature) {
            "test￨L \\￨N ￭\\￨N ￭\\￨N ￭\\￭￨N a￨L capitalized￨C lowercased￨L uppercasé￨U mixêd￨M -￨N cyrillic-б￨M");
 }
 
+TEST(TokenizerTest, CaseFeatureBPE) {
+  auto tokenizer = std::unique_ptr<ITokenizer>(
+    new Tokenizer(Tokenizer::Mode::Conservative,
+                  Tokenizer::Flags::CaseFeature | Tokenizer::Flags::JoinerAnnotate,
+                  get_data("bpe-models/testcode")));
+  // The case is extracted from each BPE piece. The lowercase form of ǅ is ǆ although
+  // it is not an uppercase letter, and the one of İ is shorter.
+  test_tok(tokenizer,
+           "Abcdimprovement ǅabcd İmprovement",
+           "a￭￨C b￭￨L c￭￨L d￭￨L impr￭￨L ovemen￭￨L t￨L ǆ￭￨N a￭￨L b￭￨L c￭￨L d￨L "
+           "i￭￨C m￭￨L pr￭￨L ovemen￭￨L t￨L");
+}
+
+TEST(TokenizerTest, CaseFeatureCasedJoiner) {
+  auto tokenizer = std::unique_ptr<ITokenizer>(
+    new Tokenizer(Tokenizer::Mode::Aggressive,
+                  Tokenizer::Flags::CaseFeature | Tokenizer::Flags::JoinerAnnotate,
+                  "",
+                  "J"));
+  // The case is extracted from the token with its joiners.
+  test_tok(tokenizer, "Hello, world-B", "hello￨C j,￨C world￨L j-j￨U b￨C");
+}
+
 TEST(TokenizerTest, SegmentCase) {
   auto tokenizer = std::unique_ptr<ITokenizer>(
     new Tokenizer(Tokenizer::Mode::Conservative,
@@ -143,6 +323,41 @@ TEST(TokenizerTest, SegmentNumbers) {
                      "1￭ 9￭ 8￭ 4 mille neuf cent quatrevingt ￭-￭ quatre");
 }
 
+TEST(TokenizerTest, SegmentAlphabet) {
+  auto tokenizer = std::unique_ptr<ITokenizer>(
+    new Tokenizer(Tokenizer::Mode::Conservative,
+                  Tokenizer::Flags::JoinerAnnotate | Tokenizer::Flags::SegmentAlphabetChange));
+  test_tok_and_detok(tokenizer, "rawБ 3D東京タワー", "raw￭ Б 3D￭ 東京￭ タワー");
+  auto alphabet_tokenizer = new Tokenizer(Tokenizer::Mode::Conservative,
+                                          Tokenizer::Flags::JoinerAnnotate);
+  alphabet_tokenizer->add_alphabet_to_segment("Han");
+  tokenizer.reset(alphabet_tokenizer);
+  test_tok_and_detok(tokenizer, "a東京タワー", "a￭ 東￭ 京￭ タワー");
+  // U+20000, in CJK Extension B.
+  test_tok_and_detok(tokenizer, "a東\xf0\xa0\x80\x80", "a￭ 東￭ \xf0\xa0\x80\x80");
+  EXPECT_THROW(alphabet_tokenizer->add_alphabet_to_segment("Klingon"), std::invalid_argument);
+}
+
+TEST(UnicodeTest, Scripts) {
+  EXPECT_EQ(unicode::get_script_id("Latin"), unicode::get_script('a'));
+  EXPECT_EQ(unicode::get_script_id("Han"), unicode::get_script(0x6771));
+  EXPECT_EQ(unicode::get_script_id("Hiragana"), unicode::get_script(0x3042));
+  EXPECT_EQ(unicode::_script_common, unicode::get_script('1'));
+  EXPECT_EQ(unicode::_script_inherited, unicode::get_script(0x0301));
+  EXPECT_EQ(unicode::_script_unknown, unicode::get_script(0x10FFFF));
+  EXPECT_EQ(-1, unicode::get_script_id("Klingon"));
+
+  // Letters and scripts come from the same Unicode version.
+  unicode::_type_letter type_letter;
+  EXPECT_EQ(unicode::get_script_id("Han"), unicode::get_script(0x20000));
+  EXPECT_TRUE(unicode::is_letter(0x20000, type_letter));
+  EXPECT_EQ(unicode::_letter_other, type_letter);
+  EXPECT_EQ(unicode::get_script_id("Deseret"), unicode::get_script(0x10400));
+  EXPECT_TRUE(unicode::is_letter(0x10400, type_letter));
+  EXPECT_EQ(unicode::_letter_upper, type_letter);
+  EXPECT_EQ(0x10428, unicode::get_lower(0x10400));
+}
+
 TEST(TokenizerTest, BPEBasic) {
   auto tokenizer = std::unique_ptr<ITokenizer>(
     new Tokenizer(Tokenizer::Mode::Conservative, Tokenizer::Flags::JoinerAnnotate,
@@ -188,6 +403,716 @@ TEST(TokenizerTest, BPECaseInsensitive) {
            "Seulement seulement il va is n on seulement seu l em ent n on à Ver d un");
 }
 
+TEST(TokenizerTest, BPEDuplicatePairs) {
+  // "b c" is listed again after "a b" and keeps the rank of its first line.
+  BPE bpe(get_data("bpe-models/codes_duplicates"));
+  EXPECT_EQ(std::vector<std::string>({"a", "bc"}), bpe.encode("abc"));
+  EXPECT_EQ(std::vector<std::string>({"ab"}), bpe.encode("ab"));
+}
+
+TEST(TokenizerTest, BPECodePoints) {
+  BPE bpe(get_data("bpe-models/codes_suffix_case_insensitive.fr"));
+  const std::string word = "ConstitutionnellemenT";
+  std::vector<unicode::code_point_t> code_points(word.size());
+  for (const auto& c: unicode::Utf8Range(word))
+    code_points[c.offset] = c.code_point;
+
+  Workspace workspace;
+  std::vector<StringView> pieces;
+  bpe.encode(word, code_points.data(), pieces, workspace);
+  std::vector<std::string> expected = bpe.encode(word);
+  ASSERT_EQ(expected.size(), pieces.size());
+  for (size_t i = 0; i < pieces.size(); ++i)
+    EXPECT_EQ(StringView(expected[i]), pieces[i]);
+}
+
+TEST(UnicodeTest, CharacterProperties) {
+  unicode::_type_letter type_letter;
+  EXPECT_TRUE(unicode::is_letter(0x61, type_letter));
+  EXPECT_EQ(unicode::_letter_lower, type_letter);
+  EXPECT_TRUE(unicode::is_letter(0x411, type_letter));
+  EXPECT_EQ(unicode::_letter_upper, type_letter);
+  EXPECT_TRUE(unicode::is_letter(0x8054, type_letter));
+  EXPECT_EQ(unicode::_letter_other, type_letter);
+  EXPECT_FALSE(unicode::is_letter(0x31, type_letter));
+  EXPECT_TRUE(unicode::is_number(0x31));
+  EXPECT_TRUE(unicode::is_number(0xBD));
+  EXPECT_TRUE(unicode::is_separator(0x9));
+  EXPECT_TRUE(unicode::is_separator(0x3000));
+  EXPECT_FALSE(unicode::is_separator(0x200D));
+  EXPECT_TRUE(unicode::is_mark(0x94D));
+  EXPECT_EQ(0, unicode::get_properties(0));
+  EXPECT_EQ(0, unicode::get_properties(0x110000));
+}
+
+TEST(UnicodeTest, CaseMapping) {
+  EXPECT_EQ(0x61, unicode::get_lower(0x41));
+  EXPECT_EQ(0x41, unicode::get_upper(0x61));
+  EXPECT_EQ(0xE9, unicode::get_lower(0xC9));
+  EXPECT_EQ(0x178, unicode::get_upper(0xFF));
+  EXPECT_EQ(0x431, unicode::get_lower(0x411));
+  EXPECT_EQ(0x411, unicode::get_upper(0x431));
+  // The uppercase form is the smallest code point having this lowercase form.
+  EXPECT_EQ(0x6B, unicode::get_lower(0x212A));
+  EXPECT_EQ(0x4B, unicode::get_upper(0x6B));
+  EXPECT_EQ(0, unicode::get_lower(0x61));
+  EXPECT_EQ(0, unicode::get_upper(0x8054));
+  EXPECT_EQ(0, unicode::get_upper(0x10FFFF));
+}
+
+TEST(UnicodeTest, Utf8Iterator) {
+  const std::string text = "a\xc3\xa9\xe8\x81\x94\xf0\x9f\x98\x80";
+  std::vector<unicode::Utf8Char> chars;
+  for (const auto& c: unicode::Utf8Range(text))
+    chars.push_back(c);
+  ASSERT_EQ(4, chars.size());
+  EXPECT_EQ(0x61, chars[0].code_point);
+  EXPECT_EQ(0xE9, chars[1].code_point);
+  EXPECT_EQ(1, chars[1].offset);
+  EXPECT_EQ(2, chars[1].length);
+  EXPECT_EQ(0x8054, chars[2].code_point);
+  EXPECT_EQ(3, chars[2].offset);
+  EXPECT_EQ(0x1F600, chars[3].code_point);
+  EXPECT_EQ(6, chars[3].offset);
+  EXPECT_EQ(4, chars[3].length);
+  EXPECT_EQ(4, unicode::utf8len(text));
+  // An incomplete sequence does not stall the iteration.
+  const std::string incomplete = "\xe8\x81";
+  size_t count = 0;
+  for (auto it = unicode::Utf8Range(incomplete).begin(); it->length != 0; ++it)
+    ++count;
+  EXPECT_EQ(2, count);
+  // Invalid bytes are code points 0 and do not consume the valid bytes after them.
+  const std::string invalid = "\xc0" "a\xe8" "b\xed\xa0\x80";
+  std::vector<unicode::code_point_t> code_points;
+  for (const auto& c: unicode::Utf8Range(invalid))
+    code_points.push_back(c.code_point);
+  EXPECT_EQ(std::vector<unicode::code_point_t>({0, 0x61, 0, 0x62, 0, 0, 0}), code_points);
+}
+
+TEST(UnicodeTest, SplitUtf8) {
+  std::vector<StringView> fragments = unicode::split_utf8(" a\xef\xbf\xa8" "b  c ", " ");
+  ASSERT_EQ(5, fragments.size());
+  EXPECT_EQ("", fragments[0]);
+  EXPECT_EQ("a\xef\xbf\xa8" "b", fragments[1]);
+  EXPECT_EQ("", fragments[2]);
+  EXPECT_EQ("c", fragments[3]);
+  EXPECT_EQ("", fragments[4]);
+  fragments = unicode::split_utf8(fragments[1], "\xef\xbf\xa8");
+  ASSERT_EQ(2, fragments.size());
+  EXPECT_EQ("a", fragments[0]);
+  EXPECT_EQ("b", fragments[1]);
+  EXPECT_TRUE(unicode::split_utf8("", " ").empty());
+  const std::string long_text = std::string(100, 'a') + "\xc3\xa9\xe8\x81\x94\xf0\x9f\x98\x80";
+  EXPECT_EQ(103, unicode::utf8len(long_text));
+}
+
+TEST(UnicodeTest, ValidateUtf8) {
+  // Long enough to go through the vectorized validation.
+  const std::string ascii(100, 'a');
+  const std::string valid = ascii + "\xc3\xa9\xe8\x81\x94\xf0\x9f\x98\x80" + ascii;
+  EXPECT_EQ(valid.size(), unicode::validate_utf8(valid.data(), valid.size()));
+  const std::string overlong = ascii + "\xc0\xaf" + ascii;
+  EXPECT_EQ(100, unicode::validate_utf8(overlong.data(), overlong.size()));
+  const std::string surrogate = ascii + "\xed\xa0\x80" + ascii;
+  EXPECT_EQ(100, unicode::validate_utf8(surrogate.data(), surrogate.size()));
+  const std::string truncated = ascii + "\xe8\x81";
+  EXPECT_EQ(100, unicode::validate_utf8(truncated.data(), truncated.size()));
+  EXPECT_EQ("a\xef\xbf\xbd" "b\xef\xbf\xbd\xef\xbf\xbd",
+            unicode::sanitize_utf8("a\xe8\x81" "b\xff\x80", unicode::InvalidUtf8::Replace));
+  EXPECT_EQ("ab", unicode::sanitize_utf8("a\xe8\x81" "b\xff\x80", unicode::InvalidUtf8::Skip));
+  EXPECT_THROW(unicode::sanitize_utf8("a\xff", unicode::InvalidUtf8::Throw),
+               std::invalid_argument);
+
+  // Positions in the sanitized text are mapped to the input.
+  const StringView invalid = "a\xe8\x81" "b\xff\x80";
+  EXPECT_EQ(1, unicode::get_unsanitized_offset(invalid, unicode::InvalidUtf8::Replace, 1));
+  EXPECT_EQ(1, unicode::get_unsanitized_offset(invalid, unicode::InvalidUtf8::Replace, 2));
+  EXPECT_EQ(3, unicode::get_unsanitized_offset(invalid, unicode::InvalidUtf8::Replace, 4));
+  EXPECT_EQ(4, unicode::get_unsanitized_offset(invalid, unicode::InvalidUtf8::Replace, 5));
+  EXPECT_EQ(1, unicode::get_unsanitized_offset(invalid, unicode::InvalidUtf8::Skip, 1));
+  EXPECT_EQ(4, unicode::get_unsanitized_offset(invalid, unicode::InvalidUtf8::Skip, 2));
+}
+
+TEST(UnicodeTest, Normalization) {
+  std::string normalized;
+  // Already normalized text is not copied.
+  EXPECT_FALSE(unicode::normalize("caf\xc3\xa9 \xef\xac\x81", unicode::NormalizationForm::NFC,
+                                  normalized));
+  EXPECT_TRUE(normalized.empty());
+  // e followed by a combining acute accent.
+  EXPECT_TRUE(unicode::normalize("cafe\xcc\x81", unicode::NormalizationForm::NFC, normalized));
+  EXPECT_EQ("caf\xc3\xa9", normalized);
+  // Ligature fi.
+  EXPECT_TRUE(unicode::normalize("\xef\xac\x81", unicode::NormalizationForm::NFKC, normalized));
+  EXPECT_EQ("fi", normalized);
+  // Combining marks are reordered: dot below (220) before acute (230).
+  EXPECT_TRUE(unicode::normalize("a\xcc\x81\xcc\xa3", unicode::NormalizationForm::NFC,
+                                 normalized));
+  EXPECT_EQ("\xe1\xba\xa1\xcc\x81", normalized);
+  // Hangul jamo are composed into a syllable.
+  EXPECT_TRUE(unicode::normalize("\xe1\x84\x80\xe1\x85\xa1\xe1\x86\xa8",
+                                 unicode::NormalizationForm::NFC, normalized));
+  EXPECT_EQ("\xea\xb0\x81", normalized);
+
+  // Positions in the normalized text are mapped to the input, or before the characters
+  // normalized together.
+  std::vector<unicode::code_point_t> code_points;
+  const StringView nfc = "cafe\xcc\x81 x";
+  EXPECT_EQ(3, unicode::get_unnormalized_offset(nfc, unicode::NormalizationForm::NFC, 3,
+                                                code_points));
+  EXPECT_EQ(3, unicode::get_unnormalized_offset(nfc, unicode::NormalizationForm::NFC, 4,
+                                                code_points));
+  EXPECT_EQ(6, unicode::get_unnormalized_offset(nfc, unicode::NormalizationForm::NFC, 5,
+                                                code_points));
+  EXPECT_EQ(7, unicode::get_unnormalized_offset(nfc, unicode::NormalizationForm::NFC, 6,
+                                                code_points));
+  const StringView nfkc = "a\xef\xac\x81";
+  EXPECT_EQ(1, unicode::get_unnormalized_offset(nfkc, unicode::NormalizationForm::NFKC, 1,
+                                                code_points));
+  EXPECT_EQ(1, unicode::get_unnormalized_offset(nfkc, unicode::NormalizationForm::NFKC, 2,
+                                                code_points));
+  EXPECT_EQ(4, unicode::get_unnormalized_offset(nfkc, unicode::NormalizationForm::NFKC, 3,
+                                                code_points));
+}
+
+TEST(TokenizerTest, Normalization) {
+  auto tokenizer = std::unique_ptr<ITokenizer>(
+    new Tokenizer(Tokenizer::Mode::Conservative, Tokenizer::Flags::NormalizeNFC));
+  test_tok(tokenizer, "Cafe\xcc\x81 \xef\xac\x81", "Caf\xc3\xa9 \xef\xac\x81");
+  tokenizer.reset(new Tokenizer(Tokenizer::Mode::Conservative, Tokenizer::Flags::NormalizeNFKC));
+  test_tok(tokenizer, "Cafe\xcc\x81 \xef\xac\x81", "Caf\xc3\xa9 fi");
+
+  // The normalized text is stored in the workspace.
+  Tokenizer nfkc(Tokenizer::Mode::Conservative, Tokenizer::Flags::NormalizeNFKC);
+  const std::string text = "Cafe\xcc\x81 \xef\xac\x81 \xe1\x84\x80\xe1\x85\xa1";
+  Workspace workspace;
+  TokenBatch batch;
+  nfkc.tokenize(text, batch, workspace);
+  expect_no_allocation([&] { nfkc.tokenize(text, batch, workspace); });
+  ASSERT_EQ(3, batch.size());
+  EXPECT_EQ(StringView("\xea\xb0\x80"), batch.token(2));
+}
+
+TEST(TokenizerTest, InvalidUtf8) {
+  auto tokenizer = std::unique_ptr<ITokenizer>(
+    new Tokenizer(Tokenizer::Mode::Conservative));
+  test_tok(tokenizer, "Hello\xff world", "Hello \xef\xbf\xbd world");
+  tokenizer.reset(new Tokenizer(Tokenizer::Mode::Conservative,
+                                Tokenizer::Flags::SkipInvalidUtf8));
+  test_tok(tokenizer, "Hello\xff world", "Hello world");
+  tokenizer.reset(new Tokenizer(Tokenizer::Mode::Conservative,
+                                Tokenizer::Flags::ThrowOnInvalidUtf8));
+  std::vector<std::string> words;
+  std::vector<std::vector<std::string> > features;
+  EXPECT_THROW(tokenizer->tokenize("Hello\xff world", words, features),
+               std::invalid_argument);
+}
+
+TEST(TokenizerTest, TokenSpans) {
+  Tokenizer tokenizer(Tokenizer::Mode::Aggressive, Tokenizer::Flags::JoinerAnnotate);
+  const std::string text = "Hello World-10 a％b";
+  std::vector<TokenSpan> spans;
+  tokenizer.tokenize(text, spans);
+  ASSERT_EQ(7, spans.size());
+  EXPECT_EQ(6, spans[1].begin);
+  EXPECT_EQ(11, spans[1].end);
+  EXPECT_EQ(11, spans[2].begin);
+  EXPECT_EQ(12, spans[2].end);
+  EXPECT_TRUE(spans[2].joiner_left);
+  EXPECT_TRUE(spans[2].joiner_right);
+  EXPECT_FALSE(spans[2].substituted);
+  EXPECT_FALSE(spans[3].joiner_left);
+  EXPECT_TRUE(spans[5].substituted);
+  EXPECT_EQ("%", Tokenizer::get_token_text(text, spans[5]));
+  EXPECT_EQ("World", Tokenizer::get_token_text(text, spans[1]));
+
+  spans.clear();
+  EXPECT_THROW(tokenizer.tokenize(StringView("Hello\xff world"), spans), std::invalid_argument);
+}
+
+TEST(TokenizerTest, TokenBatch) {
+  Tokenizer tokenizer(Tokenizer::Mode::Aggressive,
+                      Tokenizer::Flags::JoinerAnnotate | Tokenizer::Flags::CaseFeature);
+  TokenBatch batch;
+  tokenizer.tokenize("Hello WORLD-10", batch);
+  ASSERT_EQ(4, batch.size());
+  EXPECT_EQ(StringView("hello"), batch.token(0));
+  EXPECT_EQ(StringView("world"), batch.token(1));
+  EXPECT_EQ(StringView("-"), batch.token(2));
+  EXPECT_FALSE(batch.joiner_left(1));
+  EXPECT_FALSE(batch.joiner_right(1));
+  EXPECT_TRUE(batch.joiner_left(2));
+  EXPECT_TRUE(batch.joiner_right(2));
+  std::string token;
+  tokenizer.append_token(batch, 2, token);
+  EXPECT_EQ("￭-￭", token);
+  ASSERT_EQ(4, batch.case_feature().size());
+  EXPECT_EQ(CaseModifier::Type::Capitalized, batch.case_feature()[0]);
+  EXPECT_EQ(CaseModifier::Type::Uppercase, batch.case_feature()[1]);
+  EXPECT_EQ(CaseModifier::Type::None, batch.case_feature()[2]);
+  EXPECT_EQ("Hello WORLD-10", tokenizer.detokenize(batch));
+
+  tokenizer.tokenize("Test", batch);
+  ASSERT_EQ(1, batch.size());
+  EXPECT_EQ(StringView("test"), batch.token(0));
+  EXPECT_EQ(1, batch.case_feature().size());
+
+  ITokenizer& space_tokenizer = SpaceTokenizer::get_instance();
+  space_tokenizer.tokenize("a￨1￨x b￨2￨y", batch);
+  ASSERT_EQ(2, batch.size());
+  ASSERT_EQ(2, batch.num_features());
+  EXPECT_EQ(StringView("2"), batch.feature(0)[1]);
+  EXPECT_EQ(StringView("x"), batch.feature(1)[0]);
+  EXPECT_EQ("a￨1￨x b￨2￨y", space_tokenizer.detokenize(batch));
+
+  // Each feature has a value per token.
+  batch.add_feature().push_back("z");
+  EXPECT_THROW(space_tokenizer.detokenize(batch), std::invalid_argument);
+  tokenizer.tokenize("Hello WORLD", batch);
+  batch.case_feature().pop_back();
+  EXPECT_THROW(tokenizer.detokenize(batch), std::invalid_argument);
+}
+
+TEST(TokenizerTest, TokenBatchJoinersInSpaceMode) {
+  Tokenizer tokenizer(Tokenizer::Mode::Space, Tokenizer::Flags::JoinerAnnotate);
+  TokenBatch batch;
+  tokenizer.tokenize("Hello ￭, world￭ ￭ !", batch);
+  ASSERT_EQ(5, batch.size());
+  EXPECT_EQ(StringView(","), batch.token(1));
+  EXPECT_TRUE(batch.joiner_left(1));
+  EXPECT_FALSE(batch.joiner_right(1));
+  EXPECT_EQ(StringView("world"), batch.token(2));
+  EXPECT_FALSE(batch.joiner_left(2));
+  EXPECT_TRUE(batch.joiner_right(2));
+  EXPECT_EQ(StringView("￭"), batch.token(3));
+  EXPECT_FALSE(batch.joiner_left(3));
+  EXPECT_FALSE(batch.joiner_right(3));
+  EXPECT_EQ("Hello, world!", tokenizer.detokenize(batch));
+  EXPECT_EQ("Hello ￭, world￭ ￭ !", SpaceTokenizer::get_instance().detokenize(batch));
+
+  std::vector<TokenSpan> spans;
+  tokenizer.tokenize(StringView("a ￭b￭"), spans);
+  ASSERT_EQ(2, spans.size());
+  EXPECT_EQ(5, spans[1].begin);
+  EXPECT_EQ(6, spans[1].end);
+  EXPECT_TRUE(spans[1].joiner_left);
+  EXPECT_TRUE(spans[1].joiner_right);
+}
+
+TEST(TokenizerTest, WorkspaceNoAllocation) {
+  Tokenizer tokenizer(Tokenizer::Mode::Aggressive,
+                      Tokenizer::Flags::JoinerAnnotate | Tokenizer::Flags::CaseFeature,
+                      get_data("bpe-models/testcode"));
+  const std::string text = "Hello World, 12.5% of ｟ph｠ tests!";
+  Workspace workspace;
+  TokenBatch batch;
+  std::string detokenized;
+  tokenizer.tokenize(text, batch, workspace);
+  tokenizer.detokenize(batch, detokenized);
+
+  expect_no_allocation([&] {
+    tokenizer.tokenize(text, batch, workspace);
+    tokenizer.detokenize(batch, detokenized);
+  });
+  EXPECT_EQ(text, detokenized);
+}
+
+// Checks that text has expected tokens, counted with and without building them.
+static void test_count(const Tokenizer& tokenizer, const std::string& text, size_t expected) {
+  TokenBatch batch;
+  tokenizer.tokenize(text, batch);
+  EXPECT_EQ(expected, batch.size());
+  EXPECT_EQ(expected, tokenizer.count_tokens(text));
+}
+
+TEST(TokenizerTest, CountTokens) {
+  const std::string bpe_model = get_data("bpe-models/codes_bothfix.fr");
+  const int joiner_new = Tokenizer::Flags::JoinerAnnotate | Tokenizer::Flags::JoinerNew;
+  const Tokenizer conservative(Tokenizer::Mode::Conservative);
+  test_count(conservative, "", 0);
+  test_count(conservative, "   ", 0);
+  test_count(conservative, "a  b\tc", 3);
+  // Separators are counted once per sequence.
+  const Tokenizer separators(Tokenizer::Mode::Conservative, Tokenizer::Flags::WithSeparators);
+  test_count(separators, "   ", 1);
+  test_count(separators, "a  b\tc", 5);
+  // Joiners are counted when they are tokens.
+  const Tokenizer joiner(Tokenizer::Mode::Aggressive, Tokenizer::Flags::JoinerAnnotate);
+  test_count(joiner, "a-b, c", 5);
+  test_count(joiner, "｟a b｠c ｟d｠", 3);
+  const Tokenizer joiner_token(Tokenizer::Mode::Aggressive, joiner_new);
+  test_count(joiner_token, "a-b, c", 8);
+  test_count(joiner_token, "｟a b｠c ｟d｠", 4);
+  test_count(Tokenizer(Tokenizer::Mode::Aggressive,
+                       joiner_new | Tokenizer::Flags::WithSeparators),
+             "a-b, c", 9);
+  test_count(Tokenizer(Tokenizer::Mode::Aggressive, joiner_new | Tokenizer::Flags::SegmentCase),
+             "WiFi", 3);
+  // BPE subwords, and the joiners between them.
+  test_count(Tokenizer(Tokenizer::Mode::Aggressive, Tokenizer::Flags::None, bpe_model),
+             "nonseulement à", 6);
+  test_count(Tokenizer(Tokenizer::Mode::Aggressive, joiner_new, bpe_model),
+             "nonseulement à", 10);
+  // Features are not tokens.
+  test_count(Tokenizer(Tokenizer::Mode::Space, Tokenizer::Flags::CaseFeature),
+             "a￨1  B￨2", 2);
+
+  // Nothing is built.
+  const Tokenizer tokenizer(Tokenizer::Mode::Aggressive, joiner_new, bpe_model);
+  const std::string text = "Seulement nonseulement à Verdun";
+  Workspace workspace;
+  EXPECT_EQ(22, tokenizer.count_tokens(text, workspace));
+  size_t count = 0;
+  expect_no_allocation([&] { count = tokenizer.count_tokens(text, workspace); });
+  EXPECT_EQ(22, count);
+}
+
+// Checks that text is tokenized to expected IDs, with the case feature of its tokens.
+static void test_ids(const Tokenizer& tokenizer,
+                     const Vocabulary& vocabulary,
+                     const std::string& text,
+                     const std::vector<int32_t>& expected) {
+  TokenBatch batch;
+  tokenizer.tokenize(text, batch);
+  Workspace workspace;
+  std::vector<int32_t> ids;
+  std::vector<CaseModifier::Type> case_feature;
+  tokenizer.tokenize(text, ids, vocabulary, workspace, &case_feature);
+  EXPECT_EQ(expected, ids);
+  EXPECT_EQ(batch.case_feature(), case_feature);
+}
+
+TEST(TokenizerTest, VocabularyIds) {
+  // Other fields after a space or a tabulation are ignored, and "le" is listed twice.
+  const Vocabulary vocabulary(get_data("vocab.txt"));
+  ASSERT_EQ(6, vocabulary.size());
+  EXPECT_EQ(0, vocabulary.lookup("le"));
+  EXPECT_EQ(1, vocabulary.lookup("chat"));
+  EXPECT_EQ("le", vocabulary.token(3).to_string());
+  // The unknown token is added after the others.
+  EXPECT_EQ(5, vocabulary.unknown_id());
+  EXPECT_EQ("<unk>", vocabulary.token(5).to_string());
+  EXPECT_EQ(5, vocabulary.lookup("chien"));
+  EXPECT_EQ(5, vocabulary.lookup(""));
+  // Tokens are looked up in pieces.
+  EXPECT_EQ(2, vocabulary.lookup("￭", ",", ""));
+  EXPECT_EQ(5, vocabulary.lookup("", ",", "￭"));
+  EXPECT_EQ(0, vocabulary.lookup("l", "e", ""));
+  EXPECT_EQ(4, vocabulary.lookup("", "", "￭"));
+
+  const Vocabulary with_unknown(get_data("vocab.txt"), "chat");
+  EXPECT_EQ(5, with_unknown.size());
+  EXPECT_EQ(1, with_unknown.unknown_id());
+  EXPECT_EQ(1, with_unknown.lookup("chien"));
+  const Vocabulary from_tokens(std::vector<std::string>{"b", "a", "b"});
+  EXPECT_EQ(0, from_tokens.lookup("b"));
+  EXPECT_EQ(3, from_tokens.unknown_id());
+  EXPECT_THROW(Vocabulary(get_data("missing-vocab.txt")), std::invalid_argument);
+
+  // The IDs are the ones of the tokens, lowercased with the case feature.
+  const Tokenizer case_feature(Tokenizer::Mode::Conservative,
+                               Tokenizer::Flags::JoinerAnnotate
+                               | Tokenizer::Flags::CaseFeature);
+  test_ids(case_feature, vocabulary, "Le chat, le CHIEN", {0, 1, 2, 0, 5});
+  const Tokenizer joiner(Tokenizer::Mode::Conservative, Tokenizer::Flags::JoinerAnnotate);
+  test_ids(joiner, vocabulary, "Le chat, le CHIEN", {5, 1, 2, 0, 5});
+  // Joiners are looked up as tokens.
+  const Tokenizer joiner_new(Tokenizer::Mode::Conservative,
+                             Tokenizer::Flags::JoinerAnnotate | Tokenizer::Flags::JoinerNew);
+  test_ids(joiner_new, vocabulary, "chat, le", {1, 4, 5, 0});
+
+  // Tokens are not built.
+  const std::string text = "Le chat, le CHIEN";
+  Workspace workspace;
+  std::vector<int32_t> ids;
+  case_feature.tokenize(text, ids, vocabulary, workspace);
+  expect_no_allocation([&] { case_feature.tokenize(text, ids, vocabulary, workspace); });
+}
+
+// Checks that tokenizing text into at most max_tokens tokens returns end and the first
+// tokens of the whole text.
+static void test_max_tokens(const Tokenizer& tokenizer,
+                            const std::string& text,
+                            size_t max_tokens,
+                            size_t end) {
+  Workspace workspace;
+  TokenBatch expected;
+  tokenizer.tokenize(text, expected, workspace);
+  expected.truncate(max_tokens);
+  TokenBatch batch;
+  EXPECT_EQ(end, tokenizer.tokenize(text, batch, workspace, max_tokens));
+  expect_same_tokens(expected, batch);
+}
+
+TEST(TokenizerTest, MaxTokens) {
+  Tokenizer tokenizer(Tokenizer::Mode::Aggressive,
+                      Tokenizer::Flags::JoinerAnnotate
+                      | Tokenizer::Flags::JoinerNew
+                      | Tokenizer::Flags::CaseFeature,
+                      get_data("bpe-models/codes_bothfix.fr"));
+  // Words of 5, 9, 1 and 7 tokens with the joiners between their subwords. The
+  // position is after the last word with all its tokens.
+  const std::string text = "Seulement nonseulement à Verdun";
+  test_max_tokens(tokenizer, text, 0, 0);
+  test_max_tokens(tokenizer, text, 4, 0);
+  test_max_tokens(tokenizer, text, 5, 9);
+  test_max_tokens(tokenizer, text, 13, 9);
+  test_max_tokens(tokenizer, text, 14, 22);
+  test_max_tokens(tokenizer, text, 15, 25);
+  test_max_tokens(tokenizer, text, 21, 25);
+  test_max_tokens(tokenizer, text, 22, std::string::npos);
+  test_max_tokens(tokenizer, text, 100, std::string::npos);
+
+  // Separators are tokens.
+  Tokenizer with_separators(Tokenizer::Mode::Conservative,
+                            Tokenizer::Flags::WithSeparators);
+  test_max_tokens(with_separators, "a  b", 2, 3);
+
+  // Features of the tokens left out are not added.
+  Tokenizer space(Tokenizer::Mode::Space);
+  test_max_tokens(space, "a￨1 b￨2 c￨3", 1, 5);
+
+  // Long texts are tokenized by parts.
+  std::string words;
+  for (int i = 0; i < 1000; ++i)
+    words += "word ";
+  test_max_tokens(with_separators, words, 301, 754);
+  test_max_tokens(tokenizer, words, 450, 449);
+}
+
+TEST(TokenizerTest, MaxTokensPositionInInput) {
+  // The position is in the input text when it is normalized.
+  Tokenizer nfkc(Tokenizer::Mode::Aggressive, Tokenizer::Flags::NormalizeNFKC);
+  test_max_tokens(nfkc, "\xef\xac\x81ne \xef\xac\x81ne", 1, 5);
+  // A position inside the normalized form of a character is moved before it.
+  test_max_tokens(nfkc, "a \xc2\xbd", 2, 2);
+  test_max_tokens(nfkc, "a\xef\xbc\x83 b", 2, 4);
+  Tokenizer nfc(Tokenizer::Mode::Conservative, Tokenizer::Flags::NormalizeNFC);
+  test_max_tokens(nfc, "Cafe\xcc\x81 e\xcc\x81te\xcc\x81 ok", 2, 14);
+
+  // Invalid UTF-8 is replaced or skipped.
+  Tokenizer replace(Tokenizer::Mode::Conservative);
+  test_max_tokens(replace, "a\xff b c", 1, 1);
+  test_max_tokens(replace, "a\xff b c", 2, 2);
+  test_max_tokens(replace, "a\xe2\x82 b c", 3, 5);
+  Tokenizer skip(Tokenizer::Mode::Conservative, Tokenizer::Flags::SkipInvalidUtf8);
+  test_max_tokens(skip, "a\xff b c", 1, 1);
+  test_max_tokens(skip, "a\xff b c", 2, 4);
+
+  // Only the text that is read is validated.
+  Tokenizer validate(Tokenizer::Mode::Conservative, Tokenizer::Flags::ThrowOnInvalidUtf8);
+  std::string text;
+  for (int i = 0; i < 1000; ++i)
+    text += "a ";
+  text += "\xff";
+  Workspace workspace;
+  TokenBatch batch;
+  EXPECT_EQ(19, validate.tokenize(text, batch, workspace, 10));
+  EXPECT_THROW(validate.tokenize(text, batch, workspace, 1000), std::invalid_argument);
+}
+
+TEST(TokenizerTest, SharedAcrossThreads) {
+  const Tokenizer tokenizer(Tokenizer::Mode::Aggressive,
+                            Tokenizer::Flags::JoinerAnnotate | Tokenizer::Flags::CaseFeature,
+                            get_data("bpe-models/testcode"));
+  const std::string text = "Hello World, abcdimprovement联合国 12.5% of ｟ph｠ tests!";
+  const std::string expected = tokenizer.tokenize(text);
+
+  std::vector<std::string> results(4);
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < results.size(); ++t) {
+    threads.emplace_back([&tokenizer, &text, &results, t]() {
+      Workspace workspace;
+      TokenBatch batch;
+      for (int i = 0; i < 100; ++i)
+        tokenizer.tokenize(text, batch, workspace);
+      results[t] = tokenizer.detokenize(batch);
+    });
+  }
+  for (auto& thread: threads)
+    thread.join();
+  for (const auto& result: results)
+    EXPECT_EQ(text, result);
+
+  // Configuration changes apply to a copy and leave the shared instance unchanged.
+  Tokenizer copy(tokenizer);
+  copy.set_joiner("@@");
+  EXPECT_EQ(expected, tokenizer.tokenize(text));
+  EXPECT_NE(expected, copy.tokenize(text));
+}
+
+TEST(TokenizerTest, StreamTokenizer) {
+  Tokenizer tokenizer(Tokenizer::Mode::Aggressive,
+                      Tokenizer::Flags::JoinerAnnotate | Tokenizer::Flags::CaseFeature);
+  tokenizer.add_alphabet_to_segment("Han");
+  // Multi-byte characters, a placeholder with separators, and a mark after a placeholder
+  // that takes the script of the letter before the space.
+  const std::string text = "Façade 联合 ｟a b｠́国 😀x";
+  TokenBatch expected;
+  tokenizer.tokenize(text, expected);
+
+  StreamTokenizer stream(tokenizer);
+  // Two chunks split at each byte, inside UTF-8 sequences and placeholders.
+  for (size_t split = 0; split <= text.size(); ++split) {
+    SCOPED_TRACE(split);
+    TokenBatch batch;
+    stream.feed(StringView(text).substr(0, split), batch);
+    stream.feed(StringView(text).substr(split), batch);
+    stream.finish(batch);
+    expect_same_tokens(expected, batch);
+  }
+
+  // One byte at a time, with features in space mode.
+  Tokenizer space(Tokenizer::Mode::Space, Tokenizer::Flags::CaseFeature);
+  const std::string features_text = "Façade￨1￨x 联合￨2￨y";
+  space.tokenize(features_text, expected);
+  StreamTokenizer space_stream(space);
+  TokenBatch batch;
+  for (const char c : features_text)
+    space_stream.feed(StringView(&c, 1), batch);
+  space_stream.finish(batch);
+  expect_same_tokens(expected, batch);
+
+  // Tokens are added once a separator follows them.
+  batch.clear();
+  stream.feed("Hello Wor", batch);
+  ASSERT_EQ(1, batch.size());
+  EXPECT_EQ(StringView("hello"), batch.token(0));
+  stream.feed("ld", batch);
+  EXPECT_EQ(1, batch.size());
+  stream.finish(batch);
+  EXPECT_EQ("Hello World", tokenizer.detokenize(batch));
+}
+
+TEST(TokenizerTest, ParallelTokenize) {
+  Tokenizer tokenizer(Tokenizer::Mode::Aggressive,
+                      Tokenizer::Flags::JoinerAnnotate
+                      | Tokenizer::Flags::CaseFeature
+                      | Tokenizer::Flags::SegmentCase
+                      | Tokenizer::Flags::SegmentAlphabetChange);
+  tokenizer.add_alphabet_to_segment("Han");
+  std::string text;
+  while (text.size() < 300000)
+    text += "line " + std::to_string(text.size()) + " of the text, ";
+  text.resize(300000);
+
+  // With 2, 3 and 4 threads, the text is first cut at these offsets: the parts must
+  // start further, where the tokenization state is reset.
+  const auto repeat = [](const std::string& pattern, size_t times) {
+    std::string repeated;
+    for (size_t i = 0; i < times; ++i)
+      repeated += pattern;
+    return repeated;
+  };
+  const std::vector<std::pair<size_t, std::string>> cuts = {
+    // A placeholder with letters after separators.
+    {150000 - 1000, "｟" + repeat("a ", 1000) + "｠"},
+    // Numbers and marks after separators, where parts do not start.
+    {100000 - 10, repeat("ÉTÉ 12.5% \xcc\x81" "Ab ", 150)},
+    // The middle of a character, in letters segmented one by one.
+    {200000 - 1001, repeat("联 合 国 ", 200)},
+    // Script and case changes.
+    {75000 - 10, repeat(" ΩMega ÉTÉ été", 200)},
+    {225000 - 10, repeat("Été ÉTÉ\n", 300)},
+  };
+  for (const auto& cut : cuts)
+    text.replace(cut.first, cut.second.size(), cut.second);
+  ASSERT_EQ(300000, text.size());
+
+  TokenBatch expected;
+  tokenizer.tokenize(text, expected);
+  for (size_t num_threads: {2, 3, 4}) {
+    SCOPED_TRACE(num_threads);
+    TokenBatch batch;
+    tokenizer.tokenize(text, batch, num_threads);
+    expect_same_tokens(expected, batch);
+  }
+
+  // The error is reported at its position in the whole text.
+  Tokenizer strict(Tokenizer::Mode::Conservative, Tokenizer::Flags::ThrowOnInvalidUtf8);
+  const size_t invalid = text.find(' ', 250000);
+  text[invalid] = '\xFF';
+  TokenBatch batch;
+  try {
+    strict.tokenize(text, batch, 4);
+    FAIL() << "expected std::invalid_argument";
+  } catch (const std::invalid_argument& e) {
+    EXPECT_EQ("Invalid UTF-8 sequence at byte " + std::to_string(invalid), e.what());
+  }
+}
+
+static void expect_same_tokens(const Tokenizer& tokenizer,
+                               const std::string& text,
+                               const TokenizedText& tokenized) {
+  ASSERT_EQ(text, tokenized.text());
+  TokenBatch expected;
+  TokenBatch batch;
+  tokenizer.tokenize(text, expected);
+  tokenized.get_tokens(batch);
+  EXPECT_EQ(expected.size(), tokenized.num_tokens());
+  expect_same_tokens(expected, batch);
+}
+
+// Applies the edit to text and tokenized, and checks their tokens.
+static void test_replace(const Tokenizer& tokenizer,
+                         std::string& text,
+                         TokenizedText& tokenized,
+                         size_t offset,
+                         size_t length,
+                         const std::string& replacement) {
+  text.replace(offset, length, replacement);
+  tokenized.replace(offset, length, replacement);
+  expect_same_tokens(tokenizer, text, tokenized);
+}
+
+TEST(TokenizerTest, TokenizedText) {
+  Tokenizer tokenizer(Tokenizer::Mode::Aggressive,
+                      Tokenizer::Flags::JoinerAnnotate
+                      | Tokenizer::Flags::CaseFeature
+                      | Tokenizer::Flags::SegmentAlphabetChange);
+  std::string text;
+  for (int i = 0; i < 40; ++i)
+    text += "Paragraphe " + std::to_string(i) + " : l'ÉTÉ à 北京, ｟x y｠́δ. ";
+  TokenizedText tokenized(tokenizer);
+  tokenized.replace(0, 0, text);
+  expect_same_tokens(tokenizer, text, tokenized);
+
+  // Edits open and close placeholders, change the script before a mark, join words and
+  // replace ranges that span several blocks.
+  test_replace(tokenizer, text, tokenized, 1000, 0, "｟");
+  test_replace(tokenizer, text, tokenized, 1003, 1, "");
+  test_replace(tokenizer, text, tokenized, 1500, 2, "x　");
+  test_replace(tokenizer, text, tokenized, 400, 1, "中");
+  test_replace(tokenizer, text, tokenized, 700, 900, "Лето");
+  test_replace(tokenizer, text, tokenized, 0, 10, "｠ ");
+  test_replace(tokenizer, text, tokenized, text.size() - 300, 0, " ｟abc");
+  test_replace(tokenizer, text, tokenized, 300, 1, "");
+
+  tokenized.replace(0, text.size(), "");
+  EXPECT_EQ(0, tokenized.size());
+  EXPECT_EQ(0, tokenized.num_tokens());
+  EXPECT_THROW(tokenized.replace(1, 0, "a"), std::invalid_argument);
+}
+
+TEST(TokenizerTest, TokenizedTextEditsAtStart) {
+  Tokenizer tokenizer(Tokenizer::Mode::Conservative, Tokenizer::Flags::JoinerAnnotate);
+  std::string text;
+  for (int i = 0; i < 5000; ++i)
+    text += "Line " + std::to_string(i) + " of a long document, 12.5% done.\n";
+  TokenizedText tokenized(tokenizer, text);
+
+  // Each edit is at the start of the text, before thousands of blocks.
+  test_replace(tokenizer, text, tokenized, 0, 0, "A");
+  test_replace(tokenizer, text, tokenized, 0, 1, "");
+  test_replace(tokenizer, text, tokenized, 4, 1, "");
+  test_replace(tokenizer, text, tokenized, 1, 0, " ");
+  test_replace(tokenizer, text, tokenized, 0, 3, "Ligne");
+  test_replace(tokenizer, text, tokenized, 2, 0, "｟ph ");
+  test_replace(tokenizer, text, tokenized, 10, 0, "｠");
+  test_replace(tokenizer, text, tokenized, 0, 200, "Start");
+}
+
 int main(int argc, char *argv[]) {
   testing::InitGoogleTest(&argc, argv);
   assert(argc == 2);
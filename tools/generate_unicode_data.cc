@@ -0,0 +1,516 @@
+// Generates src/unicode/Data.cc from the Unicode Character Database files UnicodeData.txt,
+// CompositionExclusions.txt and Scripts.txt.
+//
+// Usage: generate_unicode_data UnicodeData.txt CompositionExclusions.txt Scripts.txt Data.cc
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "onmt/unicode/Data.h"
+
+using namespace onmt::unicode;
+
+static const code_point_t max_code_point = 0x10FFFF;
+
+static std::vector<std::string> split(const std::string& line, char sep)
+{
+  std::vector<std::string> fields;
+  std::string field;
+  std::istringstream iss(line);
+  while (std::getline(iss, field, sep))
+    fields.push_back(field);
+  return fields;
+}
+
+static unsigned char category_to_properties(const std::string& category)
+{
+  if (category == "Lu")
+    return _prop_letter | _prop_letter_upper;
+  if (category == "Ll")
+    return _prop_letter | _prop_letter_lower;
+  switch (category[0])
+  {
+  case 'L':
+    return _prop_letter;
+  case 'N':
+    return _prop_number;
+  case 'M':
+    return _prop_mark;
+  case 'Z':
+    return _prop_separator;
+  default:
+    return 0;
+  }
+}
+
+static void read_unicode_data(const std::string& path,
+                              std::vector<unsigned char>& props,
+                              std::map<code_point_t, code_point_t>& lower)
+{
+  std::ifstream in(path.c_str());
+  if (!in.is_open())
+    throw std::invalid_argument("Unable to open `" + path + "'");
+
+  std::string line;
+  code_point_t range_first = 0;
+
+  while (std::getline(in, line))
+  {
+    if (line.empty())
+      continue;
+
+    std::vector<std::string> fields = split(line, ';');
+    if (fields.size() < 3)
+      throw std::runtime_error("Invalid line: " + line);
+
+    code_point_t u = std::stoul(fields[0], nullptr, 16);
+    const std::string& name = fields[1];
+    unsigned char value = category_to_properties(fields[2]);
+
+    if (name.find(", First>") != std::string::npos)
+    {
+      range_first = u;
+      continue;
+    }
+
+    code_point_t first = name.find(", Last>") != std::string::npos ? range_first : u;
+    for (code_point_t v = first; v <= u; ++v)
+      props[v] = value;
+
+    if (fields.size() > 13 && !fields[13].empty())
+      lower[u] = std::stoul(fields[13], nullptr, 16);
+  }
+
+  // Control characters from TAB to CR are considered as separators.
+  for (code_point_t u = 9; u <= 13; ++u)
+    props[u] |= _prop_separator;
+
+  // CJK Unified Ideographs, Kangxi Radicals, CJK Radicals Supplement, Hiragana,
+  // Katakana, Bopomofo, Hangul Compatibility Jamo, Kanbun, Hangul Jamo and Syllables
+  // are letters without case.
+  static const code_point_t letter_other_ranges[][2] = {
+    {0x4E00, 0x9FD5},
+    {0x2F00, 0x2FD5},
+    {0x2E80, 0x2EFF},
+    {0x3040, 0x319F},
+    {0x1100, 0x11FF},
+    {0xAC00, 0xD7AF}
+  };
+
+  for (const auto& range: letter_other_ranges)
+  {
+    for (code_point_t u = range[0]; u <= range[1]; ++u)
+    {
+      props[u] &= ~(_prop_letter_lower | _prop_letter_upper);
+      props[u] |= _prop_letter;
+    }
+  }
+
+  props[0] = 0;
+}
+
+struct RawDecomposition
+{
+  bool compatibility;
+  std::vector<code_point_t> mapping;
+};
+
+static void read_normalization_data(const std::string& unicode_data_path,
+                                    const std::string& exclusions_path,
+                                    std::vector<unsigned char>& ccc,
+                                    std::map<code_point_t, RawDecomposition>& mappings,
+                                    std::set<code_point_t>& exclusions)
+{
+  std::ifstream in(unicode_data_path.c_str());
+  if (!in.is_open())
+    throw std::invalid_argument("Unable to open `" + unicode_data_path + "'");
+
+  std::string line;
+
+  while (std::getline(in, line))
+  {
+    std::vector<std::string> fields = split(line, ';');
+    if (fields.size() < 6)
+      continue;
+
+    code_point_t u = std::stoul(fields[0], nullptr, 16);
+    ccc[u] = std::stoul(fields[3]);
+
+    if (fields[5].empty())
+      continue;
+
+    RawDecomposition decomposition;
+    decomposition.compatibility = fields[5][0] == '<';
+    for (const auto& value: split(fields[5], ' '))
+    {
+      if (!value.empty() && value[0] != '<')
+        decomposition.mapping.push_back(std::stoul(value, nullptr, 16));
+    }
+    mappings[u] = decomposition;
+  }
+
+  std::ifstream exclusions_in(exclusions_path.c_str());
+  if (!exclusions_in.is_open())
+    throw std::invalid_argument("Unable to open `" + exclusions_path + "'");
+
+  while (std::getline(exclusions_in, line))
+  {
+    line = line.substr(0, line.find('#'));
+    if (line.find_first_not_of(" \t") != std::string::npos)
+      exclusions.insert(std::stoul(line, nullptr, 16));
+  }
+}
+
+static void append_decomposition(code_point_t u,
+                                 bool compatibility,
+                                 const std::map<code_point_t, RawDecomposition>& mappings,
+                                 std::vector<code_point_t>& decomposition)
+{
+  if (u >= hangul_s_base && u < hangul_s_base + hangul_s_count)
+  {
+    code_point_t s = u - hangul_s_base;
+    decomposition.push_back(hangul_l_base + s / hangul_n_count);
+    decomposition.push_back(hangul_v_base + (s % hangul_n_count) / hangul_t_count);
+    if (s % hangul_t_count != 0)
+      decomposition.push_back(hangul_t_base + s % hangul_t_count);
+    return;
+  }
+
+  auto it = mappings.find(u);
+  if (it == mappings.end() || (it->second.compatibility && !compatibility))
+  {
+    decomposition.push_back(u);
+    return;
+  }
+
+  for (code_point_t v: it->second.mapping)
+    append_decomposition(v, compatibility, mappings, decomposition);
+}
+
+static std::string trim(const std::string& str)
+{
+  size_t begin = str.find_first_not_of(" \t");
+  if (begin == std::string::npos)
+    return "";
+  size_t end = str.find_last_not_of(" \t");
+  return str.substr(begin, end - begin + 1);
+}
+
+// Script identifiers are the position in names: Unknown, Common and Inherited come
+// first (see _script in Unicode.h), followed by the other scripts in alphabetical order.
+static void read_scripts(const std::string& path,
+                         std::vector<unsigned char>& scripts,
+                         std::vector<std::string>& names)
+{
+  std::ifstream in(path.c_str());
+  if (!in.is_open())
+    throw std::invalid_argument("Unable to open `" + path + "'");
+
+  std::map<std::string, std::vector<std::pair<code_point_t, code_point_t> > > ranges;
+  std::string line;
+
+  while (std::getline(in, line))
+  {
+    line = line.substr(0, line.find('#'));
+    std::vector<std::string> fields = split(line, ';');
+    if (fields.size() < 2)
+      continue;
+
+    std::string range = trim(fields[0]);
+    size_t dots = range.find("..");
+    code_point_t first = std::stoul(range.substr(0, dots), nullptr, 16);
+    code_point_t last = (dots == std::string::npos
+                         ? first
+                         : std::stoul(range.substr(dots + 2), nullptr, 16));
+    ranges[trim(fields[1])].emplace_back(first, last);
+  }
+
+  names = {"Unknown", "Common", "Inherited"};
+  for (const auto& pair: ranges)
+  {
+    if (std::find(names.begin(), names.end(), pair.first) == names.end())
+      names.push_back(pair.first);
+  }
+  if (names.size() > 0xFF)
+    throw std::runtime_error("Too many scripts");
+
+  for (size_t id = 0; id < names.size(); ++id)
+  {
+    for (const auto& range: ranges[names[id]])
+    {
+      for (code_point_t u = range.first; u <= range.second; ++u)
+        scripts[u] = id;
+    }
+  }
+}
+
+template <typename T>
+static void write_array(std::ostream& os,
+                        const std::string& type,
+                        const std::string& name,
+                        const std::vector<T>& values)
+{
+  os << "    constexpr " << type << " " << name << "[" << values.size() << "] = {\n";
+  for (size_t i = 0; i < values.size(); ++i)
+  {
+    if (i % 10 == 0)
+      os << (i == 0 ? "" : ",\n") << "      ";
+    else
+      os << ", ";
+    long long value = static_cast<long long>(values[i]);
+    os << (value < 0 ? "-0x" : "0x")
+       << std::uppercase << std::hex << std::setw(4) << std::setfill('0')
+       << (value < 0 ? -value : value);
+  }
+  os << std::dec << "\n    };\n\n";
+}
+
+// Splits values in blocks of 2^block_bits entries: index maps each block to its offset
+// in blocks, where identical blocks are stored once.
+template <typename T>
+static void build_two_stage_table(const std::vector<T>& values,
+                                  unsigned int block_bits,
+                                  std::vector<unsigned int>& index,
+                                  std::vector<T>& blocks)
+{
+  const size_t block_size = 1 << block_bits;
+  std::map<std::vector<T>, unsigned int> offsets;
+
+  for (size_t i = 0; i < values.size(); i += block_size)
+  {
+    std::vector<T> block(values.begin() + i, values.begin() + i + block_size);
+    auto it = offsets.find(block);
+    if (it == offsets.end())
+    {
+      it = offsets.emplace(block, offsets.size()).first;
+      blocks.insert(blocks.end(), block.begin(), block.end());
+    }
+    index.push_back(it->second);
+  }
+}
+
+static void write_case_mapping(std::ostream& os,
+                               const std::string& name,
+                               const std::map<code_point_t, code_point_t>& mapping,
+                               code_point_t max_cased)
+{
+  std::vector<int> latin1(256, 0);
+  std::vector<int> deltas(max_cased + 1, 0);
+
+  for (const auto& pair: mapping)
+  {
+    if (pair.first < latin1.size())
+      latin1[pair.first] = pair.second;
+    deltas[pair.first] = static_cast<int>(pair.second) - static_cast<int>(pair.first);
+  }
+
+  std::vector<unsigned int> index;
+  std::vector<int> blocks;
+  build_two_stage_table(deltas, case_block_bits, index, blocks);
+
+  write_array(os, "uint16_t", name + "_latin1", latin1);
+  write_array(os, "uint16_t", name + "_index", index);
+  write_array(os, "int32_t", name + "_blocks", blocks);
+}
+
+static void write_normalization_data(std::ostream& os,
+                                     const std::vector<unsigned char>& ccc,
+                                     const std::map<code_point_t, RawDecomposition>& mappings,
+                                     const std::set<code_point_t>& exclusions)
+{
+  std::vector<unsigned int> props(ccc.begin(), ccc.end());
+  std::vector<code_point_t> code_points;
+  std::map<std::pair<code_point_t, code_point_t>, code_point_t> compositions;
+  std::ostringstream decompositions;
+  size_t decompositions_size = 0;
+
+  for (const auto& pair: mappings)
+  {
+    code_point_t u = pair.first;
+    const std::vector<code_point_t>& mapping = pair.second.mapping;
+    std::vector<code_point_t> canonical;
+    std::vector<code_point_t> compatibility;
+    append_decomposition(u, false, mappings, canonical);
+    append_decomposition(u, true, mappings, compatibility);
+
+    if (!pair.second.compatibility)
+    {
+      props[u] |= _norm_canonical_decomposition;
+      // Singletons, non-starter decompositions and excluded characters are never
+      // recomposed (Full_Composition_Exclusion).
+      if (exclusions.count(u) || mapping.size() == 1 || ccc[u] != 0 || ccc[mapping[0]] != 0)
+        props[u] |= _norm_nfc_no | _norm_nfkc_no;
+      else
+        compositions[std::make_pair(mapping[0], mapping[1])] = u;
+    }
+    else
+      canonical.clear();
+
+    props[u] |= _norm_compatibility_decomposition;
+    if (compatibility != canonical)
+      props[u] |= _norm_nfkc_no;
+
+    if (canonical.size() > 0xFF || compatibility.size() > 0xFF)
+      throw std::runtime_error("Decomposition is too long");
+    decompositions << (decompositions_size++ == 0 ? "" : ",\n")
+                   << "      {0x" << std::uppercase << std::hex << std::setw(4) << std::setfill('0')
+                   << u << std::dec << ", " << code_points.size()
+                   << ", " << canonical.size() << ", " << compatibility.size() << "}";
+    code_points.insert(code_points.end(), canonical.begin(), canonical.end());
+    code_points.insert(code_points.end(), compatibility.begin(), compatibility.end());
+  }
+
+  if (code_points.size() > 0xFFFF)
+    throw std::runtime_error("Too many decomposition code points");
+
+  // Characters that may combine with the previous character.
+  for (const auto& pair: compositions)
+    props[pair.first.second] |= _norm_nfc_maybe;
+  for (code_point_t u = hangul_v_base; u < hangul_v_base + hangul_v_count; ++u)
+    props[u] |= _norm_nfc_maybe;
+  for (code_point_t u = hangul_t_base + 1; u < hangul_t_base + hangul_t_count; ++u)
+    props[u] |= _norm_nfc_maybe;
+  for (auto& value: props)
+  {
+    if ((value & _norm_nfc_maybe) && !(value & _norm_nfkc_no))
+      value |= _norm_nfkc_maybe;
+  }
+
+  std::vector<unsigned int> index;
+  std::vector<unsigned int> blocks;
+  build_two_stage_table(props, normalization_block_bits, index, blocks);
+  write_array(os, "uint16_t", "normalization_index", index);
+  write_array(os, "uint16_t", "normalization_blocks", blocks);
+
+  os << "    constexpr Decomposition decompositions[" << decompositions_size << "] = {\n"
+     << decompositions.str()
+     << "\n    };\n"
+     << "    constexpr size_t decompositions_size = " << decompositions_size << ";\n"
+     << "\n";
+  write_array(os, "code_point_t", "decomposition_code_points", code_points);
+
+  os << "    constexpr Composition compositions[" << compositions.size() << "] = {\n";
+  for (auto it = compositions.begin(); it != compositions.end(); ++it)
+    os << (it == compositions.begin() ? "" : ",\n")
+       << "      {0x" << std::uppercase << std::hex << std::setw(4) << std::setfill('0')
+       << it->first.first << ", 0x" << std::setw(4) << it->first.second
+       << ", 0x" << std::setw(4) << it->second << std::dec << "}";
+  os << "\n    };\n"
+     << "    constexpr size_t compositions_size = " << compositions.size() << ";\n";
+}
+
+static void write_scripts(std::ostream& os,
+                          const std::vector<unsigned char>& scripts,
+                          const std::vector<std::string>& names)
+{
+  std::vector<unsigned int> index;
+  std::vector<unsigned char> blocks;
+  build_two_stage_table(scripts, script_block_bits, index, blocks);
+  write_array(os, "uint16_t", "script_index", index);
+  write_array(os, "unsigned char", "script_blocks",
+              std::vector<unsigned int>(blocks.begin(), blocks.end()));
+
+  os << "    constexpr const char* script_names[" << names.size() << "] = {\n";
+  for (size_t i = 0; i < names.size(); ++i)
+    os << (i == 0 ? "" : ",\n") << "      \"" << names[i] << "\"";
+  os << "\n    };\n"
+     << "    constexpr size_t scripts_size = " << names.size() << ";\n";
+}
+
+static void write_data(const std::string& path,
+                       const std::vector<unsigned char>& props,
+                       const std::map<code_point_t, code_point_t>& lower,
+                       const std::vector<unsigned char>& ccc,
+                       const std::map<code_point_t, RawDecomposition>& mappings,
+                       const std::set<code_point_t>& exclusions,
+                       const std::vector<unsigned char>& scripts,
+                       const std::vector<std::string>& script_names)
+{
+  std::vector<unsigned int> props_index;
+  std::vector<unsigned char> props_blocks;
+  build_two_stage_table(props, properties_block_bits, props_index, props_blocks);
+
+  // The uppercase form is the reverse of the lowercase mapping, keeping the
+  // smallest code point when several characters have the same lowercase form.
+  std::map<code_point_t, code_point_t> upper;
+  for (const auto& pair: lower)
+    upper.emplace(pair.second, pair.first);
+
+  if (lower.empty())
+    throw std::runtime_error("No case mapping found, check the UnicodeData.txt file");
+
+  // Case tables end with the last block containing a mapping.
+  const code_point_t case_block_size = 1 << case_block_bits;
+  code_point_t max_cased = std::max(lower.rbegin()->first, upper.rbegin()->first);
+  max_cased = (max_cased / case_block_size + 1) * case_block_size - 1;
+
+  std::ofstream os(path.c_str());
+  if (!os.is_open())
+    throw std::invalid_argument("Unable to open `" + path + "'");
+
+  os << "// This file is generated by tools/generate_unicode_data.cc, do not edit.\n"
+     << "\n"
+     << "#include \"onmt/unicode/Data.h\"\n"
+     << "\n"
+     << "namespace onmt\n"
+     << "{\n"
+     << "  namespace unicode\n"
+     << "  {\n"
+     << "\n";
+  write_array(os, "uint16_t", "properties_index", props_index);
+  write_array(os, "unsigned char", "properties_blocks",
+              std::vector<unsigned int>(props_blocks.begin(), props_blocks.end()));
+  os << "    constexpr code_point_t case_max_code_point = 0x"
+     << std::uppercase << std::hex << max_cased << std::dec << ";\n"
+     << "\n";
+  write_case_mapping(os, "lower", lower, max_cased);
+  write_case_mapping(os, "upper", upper, max_cased);
+  write_normalization_data(os, ccc, mappings, exclusions);
+  os << "\n";
+  write_scripts(os, scripts, script_names);
+  os << "\n"
+     << "  }\n"
+     << "}\n";
+}
+
+int main(int argc, char* argv[])
+{
+  if (argc != 5)
+  {
+    std::cerr << "Usage: " << argv[0]
+              << " UnicodeData.txt CompositionExclusions.txt Scripts.txt Data.cc" << std::endl;
+    return 1;
+  }
+
+  std::vector<unsigned char> props(max_code_point + 1, 0);
+  std::map<code_point_t, code_point_t> lower;
+  std::vector<unsigned char> ccc(max_code_point + 1, 0);
+  std::map<code_point_t, RawDecomposition> mappings;
+  std::set<code_point_t> exclusions;
+  std::vector<unsigned char> scripts(max_code_point + 1, 0);
+  std::vector<std::string> script_names;
+
+  try
+  {
+    read_unicode_data(argv[1], props, lower);
+    read_normalization_data(argv[1], argv[2], ccc, mappings, exclusions);
+    read_scripts(argv[3], scripts, script_names);
+    write_data(argv[4], props, lower, ccc, mappings, exclusions, scripts, script_names);
+  }
+  catch (const std::exception& e)
+  {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+
+  return 0;
+}